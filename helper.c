@@ -1,7 +1,98 @@
 #include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <Imlib2.h>
+#include <jpeglib.h>
 #include "helper.h"
+#include "image_cache.h"
+#include "scale.h"
+
+/** Number of screen-sized canvases kept around by the render context. */
+#define CANVAS_POOL_SIZE 4
+
+/** A screen-sized Imlib2 image which is reused between renders. */
+typedef struct {
+    unsigned int width, height;
+    Imlib_Image image;
+
+    /** Value of the render context's clock when this canvas was last used. */
+    unsigned long last_used;
+
+    /**
+     * What was last rendered on the canvas, so that the same wallpaper can be
+     * uploaded to another X screen with the same geometry without rendering
+     * it again; contents.image_path is NULL if it isn't known.
+     */
+    ImageKey contents;
+
+    /** Format of the visual the contents were last uploaded to. */
+    VisualFormat format;
+} Canvas;
+
+/**
+ * Rendering state, shared by every thread and guarded by imlib_lock. Creating
+ * an Imlib2 context, a color range, and a full-screen image for every
+ * wallpaper and screen churns through several megabytes of memory per render,
+ * so we keep them around and reuse them. Renders are serialized by imlib_lock
+ * anyway, so one pool of canvases is enough however many threads there are.
+ */
+typedef struct {
+    Imlib_Context context;
+    Imlib_Color_Range color_range;
+
+    /** Pool of canvases, keyed by geometry. */
+    Canvas canvases[CANVAS_POOL_SIZE];
+
+    /**
+     * Canvas lent out by create_wallpaper() to compress it into the image
+     * cache without holding imlib_lock, or NULL. get_canvas() leaves it
+     * alone, and only one is lent at a time so that there's always a canvas to
+     * render into.
+     */
+    Canvas *lent;
+
+    /** Incremented on every render for LRU eviction of canvases. */
+    unsigned long clock;
+} RenderContext;
+
+/** Forget what's on a canvas. */
+static void canvas_clear_contents(Canvas *canvas)
+{
+    free((char*) canvas->contents.image_path);
+    canvas->contents.image_path = NULL;
+}
+
+/** Imlib2 isn't thread-safe, so only one thread may use it at a time. */
+static pthread_mutex_t imlib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static RenderContext *shared_render_context;
+
+/**
+ * Buffer which JPEGs are decoded into, grown to fit the largest image so far.
+ * Decoded images are as big as 100 MB or more, so allocating a fresh one for
+ * every render faults in every page of it again. Decoding is serialized by
+ * imlib_lock, so one buffer is enough for all threads.
+ */
+static DATA32 *decode_buffer;
+static size_t decode_size;
+
+/**
+ * Per-thread buffer which cached images are decompressed into for uploading,
+ * grown to fit the largest screen so far. It's per-thread rather than guarded
+ * by imlib_lock so that cache hits don't wait for renders.
+ */
+typedef struct {
+    uint32_t *pixels;
+    size_t size;
+} UploadBuffer;
+
+static pthread_key_t upload_buffer_key;
+static pthread_once_t upload_buffer_once = PTHREAD_ONCE_INIT;
 
 /* See helper.h. */
 Window create_desktop_window(Display *display, int screen,
@@ -40,6 +131,26 @@ Window create_desktop_window(Display *display, int screen,
     return window;
 }
 
+/* See helper.h. */
+int is_desktop_window(Display *display, Window window)
+{
+    XErrorTrap trap;
+    XClassHint class_hint;
+    Status status;
+    int ours;
+
+    trap_x_errors(display, &trap);
+    status = XGetClassHint(display, window, &class_hint);
+    if (untrap_x_errors(&trap) || !status)
+        return 0;
+
+    ours = strcmp(class_hint.res_name, "desktop_window") == 0 &&
+           strcmp(class_hint.res_class, "OWallpaperD") == 0;
+    XFree(class_hint.res_name);
+    XFree(class_hint.res_class);
+    return ours;
+}
+
 /* See helper.h. */
 long *get_workspaces(Display *display, int screen, int num_screens)
 {
@@ -121,6 +232,303 @@ WallpaperMode wallpaper_mode_from_string(const char *mode_string)
         return WALLPAPER_MODE_NONE;
 }
 
+/**
+ * Get the render context, creating it on first use. Must be called with
+ * imlib_lock held.
+ * @return The render context, or NULL if we ran out of memory.
+ */
+static RenderContext *get_render_context(void)
+{
+    RenderContext *render_context = shared_render_context;
+
+    if (render_context)
+        return render_context;
+
+    render_context = calloc(1, sizeof(*render_context));
+    if (!render_context)
+        return NULL;
+
+    render_context->context = imlib_context_new();
+    imlib_context_push(render_context->context);
+    render_context->color_range = imlib_create_color_range();
+    imlib_context_set_color_range(render_context->color_range);
+    imlib_context_set_dither(1);
+    imlib_context_set_blend(1);
+    imlib_context_pop();
+
+    shared_render_context = render_context;
+    return render_context;
+}
+
+/**
+ * Get a canvas of the given size from the pool, evicting the least recently
+ * used canvas if there isn't one with the right geometry. Must be called with
+ * the render context pushed.
+ * @return The canvas, whose image is NULL if we ran out of memory.
+ */
+static Canvas *get_canvas(RenderContext *render_context,
+                          unsigned int width, unsigned int height)
+{
+    Canvas *canvas, *victim = NULL;
+    int i;
+
+    ++render_context->clock;
+    for (i = 0; i < CANVAS_POOL_SIZE; ++i) {
+        canvas = &render_context->canvases[i];
+        if (canvas == render_context->lent)
+            continue;
+        if (canvas->image && canvas->width == width &&
+            canvas->height == height) {
+            canvas->last_used = render_context->clock;
+            return canvas;
+        }
+        if (!victim || !canvas->image ||
+            (victim->image && canvas->last_used < victim->last_used))
+            victim = canvas;
+    }
+
+    if (victim->image) {
+        imlib_context_set_image(victim->image);
+        imlib_free_image();
+    }
+    canvas_clear_contents(victim);
+    victim->image = imlib_create_image(width, height);
+    victim->width = width;
+    victim->height = height;
+    victim->last_used = render_context->clock;
+    return victim;
+}
+
+/**
+ * Scale an image onto a region of the canvas with scale_blend_image(), which
+ * spreads the work for a single image across several threads. Imlib2's own
+ * scaler can't be used for this, since its context is global state guarded by
+ * imlib_lock.
+ * @return Zero on success, non-zero on failure.
+ */
+static int scale_image_onto(Imlib_Image image, Imlib_Image canvas, int x,
+                            int y, int width, int height)
+{
+    DATA32 *src, *dst;
+    int src_width, src_height, dst_width, dst_height, has_alpha;
+    int error;
+
+    imlib_context_set_image(image);
+    src_width = imlib_image_get_width();
+    src_height = imlib_image_get_height();
+    has_alpha = imlib_image_has_alpha();
+    src = imlib_image_get_data_for_reading_only();
+
+    imlib_context_set_image(canvas);
+    dst_width = imlib_image_get_width();
+    dst_height = imlib_image_get_height();
+    dst = imlib_image_get_data();
+
+    error = scale_blend_image((const uint32_t*) src, src_width, src_height,
+                              has_alpha, (uint32_t*) dst, dst_width,
+                              dst_height, x, y, width, height);
+
+    imlib_image_put_back_data(dst);
+    return error;
+}
+
+/** Read a 16-bit or 32-bit TIFF integer with the given byte order. */
+static unsigned long tiff_get(const unsigned char *p, int size,
+                              int big_endian)
+{
+    unsigned long value = 0;
+    int i;
+
+    for (i = 0; i < size; ++i) {
+        if (big_endian)
+            value = (value << 8) | p[i];
+        else
+            value |= (unsigned long) p[i] << (8 * i);
+    }
+    return value;
+}
+
+/** libjpeg error manager which returns to decode_jpeg() instead of exiting. */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf env;
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    longjmp(((JpegError*) cinfo->err)->env, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+}
+
+/**
+ * Get the Exif orientation of a JPEG from its saved APP1 markers.
+ * @return The orientation, or 1 (upright) if there isn't one.
+ */
+static int jpeg_orientation(j_decompress_ptr cinfo)
+{
+    jpeg_saved_marker_ptr marker;
+    const unsigned char *tiff;
+    unsigned long ifd, entries, i;
+    size_t size;
+    int big_endian;
+
+    for (marker = cinfo->marker_list; marker; marker = marker->next) {
+        if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 14 ||
+            memcmp(marker->data, "Exif\0\0", 6) != 0)
+            continue;
+
+        tiff = marker->data + 6;
+        size = marker->data_length - 6;
+        if (memcmp(tiff, "MM", 2) == 0)
+            big_endian = 1;
+        else if (memcmp(tiff, "II", 2) == 0)
+            big_endian = 0;
+        else
+            continue;
+
+        ifd = tiff_get(tiff + 4, 4, big_endian);
+        if (ifd + 2 > size)
+            continue;
+        entries = tiff_get(tiff + ifd, 2, big_endian);
+        for (i = 0; i < entries && ifd + 2 + (i + 1) * 12 <= size; ++i) {
+            const unsigned char *entry = tiff + ifd + 2 + i * 12;
+            if (tiff_get(entry, 2, big_endian) == 0x0112)
+                return (int) tiff_get(entry + 8, 2, big_endian);
+        }
+    }
+    return 1;
+}
+
+/**
+ * Decode a JPEG into an ARGB buffer with the same settings as Imlib2's JPEG
+ * loader, letting libjpeg scale it down by up to 8 as it goes. CMYK images and
+ * images with an Exif orientation are left to Imlib2, which converts them
+ * specially. This doesn't use Imlib2, so it may be called without imlib_lock.
+ * @param min_width Smallest acceptable decoded width.
+ * @param min_height Smallest acceptable decoded height; if both are zero, the
+ * image is decoded at full size.
+ * @param buffer Buffer to decode into, reallocated if it's too small.
+ * @param buffer_size Size of buffer in pixels, updated if it's reallocated.
+ * @param width Return for the decoded width.
+ * @param height Return for the decoded height.
+ * @param image_width Return for the full width of the image.
+ * @param image_height Return for the full height of the image.
+ * @return Zero on success, -1 if the file can't be decoded this way.
+ */
+static int decode_jpeg(const char *image_path, unsigned int min_width,
+                       unsigned int min_height, DATA32 **buffer,
+                       size_t *buffer_size, unsigned int *width,
+                       unsigned int *height, unsigned int *image_width,
+                       unsigned int *image_height)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegError error;
+    FILE *file;
+    JSAMPROW row;
+    unsigned char *rgb;
+    DATA32 *pixels;
+    unsigned int denom, x, y;
+
+    file = fopen(image_path, "rb");
+    if (!file)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = jpeg_error_exit;
+    error.pub.output_message = jpeg_output_message;
+    if (setjmp(error.env)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK ||
+        cinfo.jpeg_color_space == JCS_CMYK ||
+        cinfo.jpeg_color_space == JCS_YCCK ||
+        jpeg_orientation(&cinfo) != 1 ||
+        cinfo.image_width > 32767 || cinfo.image_height > 32767)
+        goto fail;
+
+    /* Every libjpeg can scale by 1/2, 1/4, and 1/8 */
+    denom = min_width || min_height ? 8 : 1;
+    for (; denom > 1; denom /= 2) {
+        if (cinfo.image_width / denom >= min_width &&
+            cinfo.image_height / denom >= min_height)
+            break;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.do_fancy_upsampling = FALSE;
+    cinfo.do_block_smoothing = FALSE;
+    jpeg_start_decompress(&cinfo);
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    *image_width = cinfo.image_width;
+    *image_height = cinfo.image_height;
+
+    if ((size_t) *width * *height > *buffer_size) {
+        free(*buffer);
+        *buffer = malloc(sizeof(DATA32) * *width * *height);
+        *buffer_size = *buffer ? (size_t) *width * *height : 0;
+        if (!*buffer)
+            goto fail;
+    }
+
+    /* Decode each row into the start of its ARGB row and widen it in place */
+    for (y = 0; y < *height; ++y) {
+        pixels = *buffer + (size_t) y * *width;
+        row = (JSAMPROW) pixels;
+        if (jpeg_read_scanlines(&cinfo, &row, 1) != 1)
+            goto fail;
+        rgb = (unsigned char*) pixels;
+        for (x = *width; x-- > 0;) {
+            DATA32 r = rgb[3 * x], g = rgb[3 * x + 1], b = rgb[3 * x + 2];
+            pixels[x] = 0xff000000 | (r << 16) | (g << 8) | b;
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    return 0;
+
+fail:
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    return -1;
+}
+
+/**
+ * Decode a JPEG at full size into decode_buffer with decode_jpeg(). Must be
+ * called with imlib_lock held.
+ * @return An image using decode_buffer, which is only valid until the next
+ * call, or NULL if the file can't be decoded this way.
+ */
+static Imlib_Image load_jpeg(const char *image_path)
+{
+    Imlib_Image image;
+    unsigned int width, height, image_width, image_height;
+
+    if (decode_jpeg(image_path, 0, 0, &decode_buffer, &decode_size, &width,
+                    &height, &image_width, &image_height))
+        return NULL;
+
+    image = imlib_create_image_using_data(width, height, decode_buffer);
+    if (image) {
+        imlib_context_set_image(image);
+        imlib_image_set_has_alpha(0);
+    }
+    return image;
+}
+
 /** Render the given image file. Code adapted from hsetroot.
  * @param root_image Imlib2 context on which to render.
  * @param image_path Path of the image file.
@@ -136,10 +544,16 @@ static int render_wallpaper(Imlib_Image root_image, const char *image_path,
     Imlib_Image buffer = 0;
     int image_width, image_height;
     int error = 0;
+    int decoded = 0;
     int top, left, x, y;
     double aspect;
 
-    buffer = imlib_load_image(image_path);
+    /* Most wallpapers are JPEGs, which we can decode without allocating */
+    buffer = load_jpeg(image_path);
+    if (buffer)
+        decoded = 1;
+    else
+        buffer = imlib_load_image(image_path);
 
     if (!buffer) {
         error = EINVAL;
@@ -161,9 +575,8 @@ static int render_wallpaper(Imlib_Image root_image, const char *image_path,
                                          image_width, image_height);
             break;
         case WALLPAPER_MODE_FILL:
-            imlib_blend_image_onto_image(buffer, 0, 0, 0,
-                                         image_width, image_height, 0, 0,
-                                         root_width, root_height);
+            error = scale_image_onto(buffer, root_image, 0, 0, root_width,
+                                     root_height);
             break;
         case WALLPAPER_MODE_FULL:
             aspect = (double) root_width / image_width;
@@ -171,11 +584,9 @@ static int render_wallpaper(Imlib_Image root_image, const char *image_path,
                 aspect = (double) root_height / image_height;
             top = (root_height - (int) (image_height * aspect)) / 2;
             left = (root_width - (int) (image_width * aspect)) / 2;
-            imlib_blend_image_onto_image(buffer, 0, 0, 0,
-                                         image_width, image_height,
-                                         left, top,
-                                         (int) (image_width * aspect),
-                                         (int) (image_height * aspect));
+            error = scale_image_onto(buffer, root_image, left, top,
+                                     (int) (image_width * aspect),
+                                     (int) (image_height * aspect));
             break;
         case WALLPAPER_MODE_TILE:
             left = (root_width - image_width) / 2;
@@ -202,63 +613,509 @@ static int render_wallpaper(Imlib_Image root_image, const char *image_path,
 out:
     if (buffer) {
         imlib_context_set_image(buffer);
-        imlib_free_image();
+        if (decoded)
+            imlib_free_image_and_decache();
+        else
+            imlib_free_image();
     }
     imlib_context_set_image(root_image);
     return error;
 }
 
+static void upload_buffer_free(void *arg)
+{
+    UploadBuffer *buffer = arg;
+
+    free(buffer->pixels);
+    free(buffer);
+}
+
+static void upload_buffer_key_create(void)
+{
+    pthread_key_create(&upload_buffer_key, upload_buffer_free);
+}
+
+/**
+ * Get the calling thread's upload buffer with room for size bytes.
+ * @return The buffer, or NULL if we ran out of memory.
+ */
+static UploadBuffer *get_upload_buffer(size_t size)
+{
+    UploadBuffer *buffer;
+
+    pthread_once(&upload_buffer_once, upload_buffer_key_create);
+
+    buffer = pthread_getspecific(upload_buffer_key);
+    if (!buffer) {
+        buffer = calloc(1, sizeof(*buffer));
+        if (!buffer)
+            return NULL;
+        if (pthread_setspecific(upload_buffer_key, buffer)) {
+            free(buffer);
+            return NULL;
+        }
+    }
+    if (buffer->size < size) {
+        free(buffer->pixels);
+        buffer->pixels = malloc(size);
+        buffer->size = buffer->pixels ? size : 0;
+        if (!buffer->pixels)
+            return NULL;
+    }
+    return buffer;
+}
+
+/**
+ * Whether a screen's default visual takes the canvas's 0xAARRGGBB pixels as
+ * they are, so that they can be uploaded without converting them.
+ */
+static int visual_takes_argb(Display *display, int screen)
+{
+    Visual *visual = DefaultVisual(display, screen);
+    XPixmapFormatValues *formats;
+    int num_formats, i, bits_per_pixel = 0;
+
+    if (DefaultDepth(display, screen) != 24 || visual->class != TrueColor ||
+        visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 ||
+        visual->blue_mask != 0xff)
+        return 0;
+
+    formats = XListPixmapFormats(display, &num_formats);
+    if (!formats)
+        return 0;
+    for (i = 0; i < num_formats; ++i) {
+        if (formats[i].depth == 24)
+            bits_per_pixel = formats[i].bits_per_pixel;
+    }
+    XFree(formats);
+    return bits_per_pixel == 32;
+}
+
+/**
+ * Decompress an image from the image cache straight into the upload buffer
+ * and put it on a new pixmap, bypassing the canvas and Imlib2's conversion.
+ * This doesn't use Imlib2, so it's done without imlib_lock.
+ * @param looked_up Set if the cache was looked up, hit or miss.
+ * @return Zero on success, non-zero if the image has to go through the canvas
+ * instead.
+ */
+static int upload_cached_image(Display *display, int screen, Window window,
+                               const ImageKey *key, Pixmap *pixmap_out,
+                               int *looked_up)
+{
+    static const uint32_t one = 1;
+    UploadBuffer *buffer;
+    XImage *ximage;
+    Pixmap pixmap;
+    GC gc;
+
+    *looked_up = 0;
+    if (!visual_takes_argb(display, screen))
+        return -1;
+    buffer = get_upload_buffer((size_t) key->width * key->height *
+                               sizeof(uint32_t));
+    if (!buffer)
+        return -1;
+
+    *looked_up = 1;
+    if (image_cache_load(key, buffer->pixels))
+        return -1;
+
+    ximage = XCreateImage(display, DefaultVisual(display, screen), 24,
+                          ZPixmap, 0, (char*) buffer->pixels, key->width,
+                          key->height, 32, 0);
+    if (!ximage)
+        return -1;
+    /* The pixels are in host byte order; Xlib swaps them if need be */
+    ximage->byte_order = *(const unsigned char*) &one ? LSBFirst : MSBFirst;
+
+    pixmap = XCreatePixmap(display, window, key->width, key->height, 24);
+    gc = XCreateGC(display, pixmap, 0, NULL);
+    XPutImage(display, pixmap, gc, ximage, 0, 0, 0, 0, key->width,
+              key->height);
+    XFreeGC(display, gc);
+
+    /* The buffer isn't the image's to free */
+    ximage->data = NULL;
+    XDestroyImage(ximage);
+
+    *pixmap_out = pixmap;
+    return 0;
+}
+
+/** See helper.h. */
+void get_visual_format(Display *display, int screen, VisualFormat *format)
+{
+    Visual *visual = DefaultVisual(display, screen);
+
+    format->depth = DefaultDepth(display, screen);
+    format->visual_class = visual->class;
+    format->red_mask = visual->red_mask;
+    format->green_mask = visual->green_mask;
+    format->blue_mask = visual->blue_mask;
+}
+
+/** See helper.h. */
+int visual_format_equal(const VisualFormat *a, const VisualFormat *b)
+{
+    return a->depth == b->depth && a->visual_class == b->visual_class &&
+           a->red_mask == b->red_mask && a->green_mask == b->green_mask &&
+           a->blue_mask == b->blue_mask;
+}
+
 /** See helper.h. Code adapted from hsetroot. */
 int create_wallpaper(Display *display, int screen, Window window,
                      XineramaScreenInfo *info,
                      const char *image_path, WallpaperMode mode,
-                     unsigned long background_color, Pixmap *pixmap_out)
+                     unsigned long background_color, int use_cache,
+                     Pixmap *pixmap_out)
 {
-    Imlib_Context *context;
+    RenderContext *render_context;
+    Canvas *canvas;
     Imlib_Image image;
     Pixmap pixmap;
-    Visual *visual;
-    Colormap colormap;
     unsigned int width, height, depth;
-    int error;
+    ImageKey key;
+    VisualFormat format;
+    struct stat st;
+    DATA32 *data = NULL;
+    int reused = 0, cached = 0, looked_up = 0, cacheable, lent = 0;
+    int error = 0;
 
-    context = imlib_context_new();
-    imlib_context_push(context);
+    key.image_path = image_path;
+    key.mode = mode;
+    key.background_color = background_color;
+    key.width = info->width;
+    key.height = info->height;
+    key.mtime.tv_sec = 0;
+    key.mtime.tv_nsec = 0;
+    if (stat(image_path, &st) == 0)
+        key.mtime = st.st_mtim;
+    cacheable = use_cache && (key.mtime.tv_sec || key.mtime.tv_nsec);
+
+    if (cacheable &&
+        upload_cached_image(display, screen, window, &key, pixmap_out,
+                            &looked_up) == 0)
+        return 0;
+
+    pthread_mutex_lock(&imlib_lock);
+
+    render_context = get_render_context();
+    if (!render_context) {
+        error = ENOMEM;
+        goto out;
+    }
+    imlib_context_push(render_context->context);
 
-    imlib_context_set_display(display);
-    visual = DefaultVisual(display, screen);
-    colormap = DefaultColormap(display, screen);
     width = info->width;
     height = info->height;
     depth = DefaultDepth(display, screen);
+    get_visual_format(display, screen, &format);
+
+    canvas = get_canvas(render_context, width, height);
+    image = canvas->image;
+    if (!image) {
+        error = ENOMEM;
+        goto pop;
+    }
+    imlib_context_set_image(image);
+
+    /*
+     * If we just rendered this for another X screen with the same visual, the
+     * canvas already has it. Otherwise, if the cache wasn't tried above
+     * because the visual needs converting, try it now, decompressing into the
+     * canvas that Imlib2 converts and uploads from
+     */
+    if (key.mtime.tv_sec || key.mtime.tv_nsec) {
+        reused = canvas->contents.image_path &&
+                 image_key_equal(&canvas->contents, &key) &&
+                 visual_format_equal(&canvas->format, &format);
+        if (!reused && cacheable && !looked_up) {
+            data = imlib_image_get_data();
+            cached = image_cache_load(&key, (uint32_t*) data) == 0;
+            imlib_image_put_back_data(data);
+        }
+    }
+
+    if (!reused && !cached) {
+        canvas_clear_contents(canvas);
+        imlib_context_set_color((background_color & 0xff0000) >> 16,
+                                (background_color & 0xff00) >> 8, 
+                                (background_color & 0xff), 0xff);
+        imlib_image_fill_rectangle(0, 0, width, height);
+
+        error = render_wallpaper(image, image_path, mode, width, height);
+        if (error)
+            goto pop;
+
+        data = imlib_image_get_data_for_reading_only();
+    }
+
+    if (!reused && (key.mtime.tv_sec || key.mtime.tv_nsec)) {
+        canvas_clear_contents(canvas);
+        canvas->contents = key;
+        canvas->contents.image_path = strdup(image_path);
+        canvas->format = format;
+    }
 
     pixmap = XCreatePixmap(display, window, width, height, depth);
 
-    imlib_context_set_visual(visual);
-    imlib_context_set_colormap(colormap);
+    imlib_context_set_display(display);
+    imlib_context_set_visual(DefaultVisual(display, screen));
+    imlib_context_set_colormap(DefaultColormap(display, screen));
     imlib_context_set_drawable(pixmap);
-    imlib_context_set_color_range(imlib_create_color_range());
+    imlib_render_image_on_drawable(0, 0);
+
+    /*
+     * Compress the canvas into the cache after letting go of imlib_lock so
+     * that other renders aren't held up, unless another canvas is already
+     * lent out for that
+     */
+    if (!reused && !cached && cacheable) {
+        if (render_context->lent) {
+            image_cache_store(&key, (const uint32_t*) data);
+        } else {
+            render_context->lent = canvas;
+            lent = 1;
+        }
+    }
+
+    *pixmap_out = pixmap;
+pop:
+    imlib_context_pop();
+out:
+    pthread_mutex_unlock(&imlib_lock);
+
+    if (lent) {
+        image_cache_store(&key, (const uint32_t*) data);
+        pthread_mutex_lock(&imlib_lock);
+        render_context->lent = NULL;
+        pthread_mutex_unlock(&imlib_lock);
+    }
+    return error;
+}
+
+/* See helper.h. */
+int image_file_loadable(const char *image_path)
+{
+    RenderContext *render_context;
+    Imlib_Image image = NULL;
+
+    pthread_mutex_lock(&imlib_lock);
+    render_context = get_render_context();
+    if (render_context) {
+        imlib_context_push(render_context->context);
+        image = imlib_load_image(image_path);
+        if (image) {
+            imlib_context_set_image(image);
+            imlib_free_image();
+        }
+        imlib_context_pop();
+    }
+    pthread_mutex_unlock(&imlib_lock);
+    return image != NULL;
+}
 
-    image = imlib_create_image(width, height);
+/** Active X error traps, see trap_x_errors(). */
+static XErrorTrap *x_error_traps;
+static pthread_mutex_t x_error_traps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Error handler which was installed before init_x_error_handler(). */
+static XErrorHandler previous_x_error_handler;
+
+static int handle_x_error(Display *display, XErrorEvent *error)
+{
+    XErrorTrap *trap;
+
+    pthread_mutex_lock(&x_error_traps_lock);
+    for (trap = x_error_traps; trap; trap = trap->next) {
+        /* The display is locked, so later requests are all the trap's */
+        if (trap->display == display &&
+            error->serial >= trap->first_request) {
+            trap->error_code = error->error_code;
+            pthread_mutex_unlock(&x_error_traps_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&x_error_traps_lock);
+    return previous_x_error_handler(display, error);
+}
+
+/* See helper.h. */
+void init_x_error_handler(void)
+{
+    previous_x_error_handler = XSetErrorHandler(handle_x_error);
+}
+
+/* See helper.h. */
+void trap_x_errors(Display *display, XErrorTrap *trap)
+{
+    XLockDisplay(display);
+    trap->display = display;
+    trap->first_request = NextRequest(display);
+    trap->error_code = 0;
+
+    pthread_mutex_lock(&x_error_traps_lock);
+    trap->next = x_error_traps;
+    x_error_traps = trap;
+    pthread_mutex_unlock(&x_error_traps_lock);
+}
+
+/* See helper.h. */
+int untrap_x_errors(XErrorTrap *trap)
+{
+    XErrorTrap **link;
+
+    pthread_mutex_lock(&x_error_traps_lock);
+    for (link = &x_error_traps; *link; link = &(*link)->next) {
+        if (*link == trap) {
+            *link = trap->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&x_error_traps_lock);
+
+    XUnlockDisplay(trap->display);
+    return trap->error_code;
+}
+
+/* See helper.h. */
+double monotonic_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* See helper.h. */
+int create_preview(Display *display, int screen, Window window,
+                   XineramaScreenInfo *info,
+                   const char *image_path, WallpaperMode mode,
+                   unsigned long background_color, Pixmap *pixmap_out)
+{
+    RenderContext *render_context;
+    Imlib_Image image, background;
+    Pixmap pixmap;
+    unsigned int root_width, root_height;
+    unsigned int decoded_width, decoded_height, full_width, full_height;
+    DATA32 *pixels = NULL;
+    size_t pixels_size = 0;
+    int image_width, image_height;
+    int left, top, width, height;
+    int decoded;
+    double aspect;
+
+    root_width = info->width;
+    root_height = info->height;
+
+    /*
+     * Decode JPEGs at a fraction of their size, but no smaller than an eighth
+     * of the screen, into a buffer of our own before taking imlib_lock, so
+     * that the preview doesn't wait for a render in progress
+     */
+    decoded = decode_jpeg(image_path, (root_width + 7) / 8,
+                          (root_height + 7) / 8, &pixels, &pixels_size,
+                          &decoded_width, &decoded_height, &full_width,
+                          &full_height) == 0;
+
+    pthread_mutex_lock(&imlib_lock);
+
+    render_context = get_render_context();
+    if (!render_context) {
+        pthread_mutex_unlock(&imlib_lock);
+        free(pixels);
+        return ENOMEM;
+    }
+    imlib_context_push(render_context->context);
+
+    if (decoded)
+        image = imlib_create_image_using_data(decoded_width, decoded_height,
+                                              pixels);
+    else
+        image = imlib_load_image(image_path);
+    if (!image) {
+        imlib_context_pop();
+        pthread_mutex_unlock(&imlib_lock);
+        free(pixels);
+        return decoded ? ENOMEM : EINVAL;
+    }
     imlib_context_set_image(image);
+    if (decoded) {
+        imlib_image_set_has_alpha(0);
+        image_width = full_width;
+        image_height = full_height;
+    } else {
+        image_width = imlib_image_get_width();
+        image_height = imlib_image_get_height();
+    }
 
-    imlib_context_set_color((background_color & 0xff0000) >> 16,
-                            (background_color & 0xff00) >> 8, 
-                            (background_color & 0xff), 0xff);
-    imlib_image_fill_rectangle(0, 0, width, height);
+    /* Work out where the full-size image would go */
+    switch (mode) {
+        case WALLPAPER_MODE_FILL:
+            left = top = 0;
+            width = root_width;
+            height = root_height;
+            break;
+        case WALLPAPER_MODE_FULL:
+            aspect = (double) root_width / image_width;
+            if ((int) (image_height * aspect) > (int) root_height)
+                aspect = (double) root_height / image_height;
+            width = (int) (image_width * aspect);
+            height = (int) (image_height * aspect);
+            left = ((int) root_width - width) / 2;
+            top = ((int) root_height - height) / 2;
+            break;
+        default:
+            width = image_width;
+            height = image_height;
+            left = ((int) root_width - width) / 2;
+            top = ((int) root_height - height) / 2;
+            break;
+    }
+
+    pixmap = XCreatePixmap(display, window, root_width, root_height,
+                           DefaultDepth(display, screen));
+
+    /* Let Imlib2 stretch it straight onto the pixmap without smoothing */
+    imlib_context_set_display(display);
+    imlib_context_set_visual(DefaultVisual(display, screen));
+    imlib_context_set_colormap(DefaultColormap(display, screen));
+    imlib_context_set_drawable(pixmap);
+    imlib_context_set_anti_alias(0);
+    imlib_context_set_dither(0);
+    imlib_context_set_blend(0);
 
+    /*
+     * Fill the background by stretching a single pixel, so that Imlib2 takes
+     * care of the color like it does for full renders rather than us
+     * allocating a colormap cell for every preview
+     */
+    background = imlib_create_image(1, 1);
+    if (background) {
+        imlib_context_set_image(background);
+        imlib_context_set_color((background_color & 0xff0000) >> 16,
+                                (background_color & 0xff00) >> 8,
+                                (background_color & 0xff), 0xff);
+        imlib_image_fill_rectangle(0, 0, 1, 1);
+        imlib_render_image_on_drawable_at_size(0, 0, root_width,
+                                               root_height);
+        imlib_free_image();
+    }
+
+    imlib_context_set_image(image);
+    imlib_render_image_on_drawable_at_size(left, top, width, height);
+    imlib_context_set_anti_alias(1);
     imlib_context_set_dither(1);
     imlib_context_set_blend(1);
 
-    error = render_wallpaper(image, image_path, mode, width, height);
-    if (error)
-        return error;
-
-    imlib_render_image_on_drawable(0, 0);
-    imlib_free_image();
-    imlib_free_color_range();
+    if (decoded)
+        imlib_free_image_and_decache();
+    else
+        imlib_free_image();
     imlib_context_pop();
-    imlib_context_free(context);
+    pthread_mutex_unlock(&imlib_lock);
+    free(pixels);
 
     *pixmap_out = pixmap;
     return 0;
@@ -1,3 +1,6 @@
+#ifndef HELPER_H
+#define HELPER_H
+
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -12,6 +15,13 @@ typedef enum {
     WALLPAPER_MODE_TILE
 } WallpaperMode;
 
+/** The pixel format of an X screen's default visual. */
+typedef struct {
+    int depth;
+    int visual_class;
+    unsigned long red_mask, green_mask, blue_mask;
+} VisualFormat;
+
 /**
  * Create a desktop window to cover an entire Xinerama screen; this is the
  * window on which we set the background image to the wallpaper.
@@ -31,6 +41,16 @@ Time get_current_time(Display *display, int screen);
  */
 WallpaperMode wallpaper_mode_from_string(const char *mode_string);
 
+/** Get the pixel format of an X screen's default visual. */
+void get_visual_format(Display *display, int screen, VisualFormat *format);
+
+/**
+ * Check whether two visual formats are the same, so that a rendered wallpaper
+ * is converted the same way for both.
+ * @return Non-zero if they are.
+ */
+int visual_format_equal(const VisualFormat *a, const VisualFormat *b);
+
 /**
  * Create a wallpaper pixmap.
  * @param window The desktop window to make the wallpaper for.
@@ -39,10 +59,84 @@ WallpaperMode wallpaper_mode_from_string(const char *mode_string);
  * @param mode The mode for rendering the wallpaper.
  * @param background_color The background color on which to render the
  * wallpaper.
+ * @param use_cache Whether to look the rendered image up in the image cache
+ * and store it there.
  * @param pixmap_out Return for the rendered pixmap.
  * @return Zero on success, non-zero on failure.
+ *
+ * This may be called from any thread; calls into Imlib2 are serialized
+ * internally since Imlib2 isn't thread-safe.
  */
 int create_wallpaper(Display *display, int screen, Window window,
                      XineramaScreenInfo *info,
                      const char *image_path, WallpaperMode mode,
-                     unsigned long background_color, Pixmap *pixmap_out);
+                     unsigned long background_color, int use_cache,
+                     Pixmap *pixmap_out);
+
+/**
+ * Create a quick, low-quality preview of a wallpaper: the image stretched into
+ * place without smoothing. JPEGs are decoded at down to 1/8 of their size
+ * (but no smaller than an eighth of the screen) without waiting for renders in
+ * progress. Takes the same arguments as create_wallpaper() except use_cache.
+ * @return Zero on success, non-zero on failure.
+ */
+int create_preview(Display *display, int screen, Window window,
+                   XineramaScreenInfo *info,
+                   const char *image_path, WallpaperMode mode,
+                   unsigned long background_color, Pixmap *pixmap_out);
+
+/**
+ * Check whether Imlib2 can load an image file. This only reads the header, so
+ * it's much cheaper than rendering the image.
+ * @return Non-zero if it can.
+ */
+int image_file_loadable(const char *image_path);
+
+/**
+ * Check whether a window is a desktop window made by create_desktop_window()
+ * (e.g., by a previous instance), going by its WM_CLASS. A window which
+ * doesn't exist doesn't trigger the X error handler.
+ * @return Non-zero if it is.
+ */
+int is_desktop_window(Display *display, Window window);
+
+/** State for trapping the X errors caused by a sequence of requests. */
+typedef struct XErrorTrap {
+    Display *display;
+
+    /** Serial number of the first request made while trapping errors. */
+    unsigned long first_request;
+
+    /** Error code of the last trapped error, or zero. */
+    int error_code;
+
+    struct XErrorTrap *next;
+} XErrorTrap;
+
+/**
+ * Install the X error handler which makes trap_x_errors() work, passing every
+ * error which isn't trapped on to the previous handler. This must be called
+ * once, before any other thread uses Xlib.
+ */
+void init_x_error_handler(void);
+
+/**
+ * Trap the X errors caused by the requests which this thread makes on a
+ * display instead of passing them to the error handler, until
+ * untrap_x_errors(). The display is locked in the meantime so that other
+ * threads' requests aren't trapped. Only requests which wait for a reply
+ * should be made, since errors for other requests may arrive after the trap is
+ * gone.
+ */
+void trap_x_errors(Display *display, XErrorTrap *trap);
+
+/**
+ * Stop trapping X errors and unlock the display.
+ * @return The error code of the last trapped error, or zero if there was none.
+ */
+int untrap_x_errors(XErrorTrap *trap);
+
+/** Get the current CLOCK_MONOTONIC time in seconds. */
+double monotonic_time(void);
+
+#endif /* HELPER_H */
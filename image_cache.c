@@ -0,0 +1,301 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lz4.h>
+#include "image_cache.h"
+
+/** A compressed image in the cache. */
+typedef struct CacheEntry {
+    /** Neighbors in the LRU list, most recently used first. */
+    struct CacheEntry *prev, *next;
+
+    ImageKey key;
+    uint32_t hash;
+
+    char *data;
+    int compressed_size;
+
+    /**
+     * Number of loads decompressing the entry without the lock. An entry
+     * which is dropped while it's pinned is taken out of the cache, but only
+     * freed by the last load.
+     */
+    int pins;
+    int dropped;
+} CacheEntry;
+
+/**
+ * LRU cache of rendered screen images compressed with LZ4. A library of
+ * wallpapers is at most a few thousand images, so entries are found by a
+ * linear scan comparing hashes, which is negligible next to decompressing
+ * several megabytes.
+ */
+static struct {
+    pthread_mutex_t lock;
+    CacheEntry *head, *tail;
+    ImageCacheStats stats;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static double cache_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t key_hash(const ImageKey *key)
+{
+    uint32_t hash = 2166136261u;
+    long mtime[2] = {key->mtime.tv_sec, key->mtime.tv_nsec};
+
+    hash = fnv1a(hash, key->image_path, strlen(key->image_path));
+    hash = fnv1a(hash, mtime, sizeof(mtime));
+    hash = fnv1a(hash, &key->mode, sizeof(key->mode));
+    hash = fnv1a(hash, &key->background_color,
+                 sizeof(key->background_color));
+    hash = fnv1a(hash, &key->width, sizeof(key->width));
+    hash = fnv1a(hash, &key->height, sizeof(key->height));
+    return hash;
+}
+
+static size_t raw_size(const ImageKey *key)
+{
+    return (size_t) key->width * key->height * sizeof(uint32_t);
+}
+
+/* See image_cache.h. */
+int image_key_equal(const ImageKey *a, const ImageKey *b)
+{
+    return a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec &&
+           a->mode == b->mode &&
+           a->background_color == b->background_color &&
+           a->width == b->width &&
+           a->height == b->height &&
+           strcmp(a->image_path, b->image_path) == 0;
+}
+
+/** Find an entry. Must be called with the lock held. */
+static CacheEntry *find_entry(const ImageKey *key, uint32_t hash)
+{
+    CacheEntry *entry;
+
+    for (entry = cache.head; entry; entry = entry->next) {
+        if (entry->hash == hash && image_key_equal(&entry->key, key))
+            return entry;
+    }
+    return NULL;
+}
+
+static void unlink_entry(CacheEntry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache.head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache.tail = entry->prev;
+}
+
+static void push_entry(CacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache.head;
+    if (cache.head)
+        cache.head->prev = entry;
+    else
+        cache.tail = entry;
+    cache.head = entry;
+}
+
+static void free_entry(CacheEntry *entry)
+{
+    free((char*) entry->key.image_path);
+    free(entry->data);
+    free(entry);
+}
+
+/**
+ * Remove an entry and free it unless it's pinned. Must be called with the
+ * lock held.
+ */
+static void drop_entry(CacheEntry *entry)
+{
+    unlink_entry(entry);
+    cache.stats.entries--;
+    cache.stats.compressed_bytes -= entry->compressed_size;
+    cache.stats.raw_bytes -= raw_size(&entry->key);
+    entry->dropped = 1;
+    if (!entry->pins)
+        free_entry(entry);
+}
+
+/**
+ * Evict the least recently used entries until there's room for size more
+ * bytes. Must be called with the lock held.
+ */
+static void make_room(size_t size)
+{
+    while (cache.tail &&
+           cache.stats.compressed_bytes + size > cache.stats.budget) {
+        drop_entry(cache.tail);
+        cache.stats.evictions++;
+    }
+}
+
+/* See image_cache.h. */
+void image_cache_set_budget(size_t budget)
+{
+    pthread_mutex_lock(&cache.lock);
+    cache.stats.budget = budget;
+    make_room(0);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* See image_cache.h. */
+int image_cache_load(const ImageKey *key, uint32_t *pixels)
+{
+    uint32_t hash = key_hash(key);
+    CacheEntry *entry;
+    double start;
+    int ok;
+
+    start = cache_time();
+    pthread_mutex_lock(&cache.lock);
+    entry = cache.stats.budget ? find_entry(key, hash) : NULL;
+    if (!entry) {
+        if (cache.stats.budget)
+            cache.stats.misses++;
+        pthread_mutex_unlock(&cache.lock);
+        return -1;
+    }
+
+    /*
+     * Pin the entry so that it isn't freed if it's evicted or replaced while
+     * we decompress it without the lock
+     */
+    entry->pins++;
+    pthread_mutex_unlock(&cache.lock);
+
+    ok = LZ4_decompress_safe(entry->data, (char*) pixels,
+                             entry->compressed_size,
+                             (int) raw_size(key)) == (int) raw_size(key);
+
+    pthread_mutex_lock(&cache.lock);
+    entry->pins--;
+    if (ok) {
+        cache.stats.hits++;
+        cache.stats.hit_time += cache_time() - start;
+    } else {
+        cache.stats.misses++;
+    }
+
+    if (entry->dropped) {
+        if (!entry->pins)
+            free_entry(entry);
+    } else if (ok) {
+        unlink_entry(entry);
+        push_entry(entry);
+    } else {
+        /* Don't keep an entry which can't be decompressed */
+        drop_entry(entry);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return ok ? 0 : -1;
+}
+
+/* See image_cache.h. */
+void image_cache_store(const ImageKey *key, const uint32_t *pixels)
+{
+    CacheEntry *entry, *old;
+    size_t size = raw_size(key);
+    int bound, compressed_size;
+    char *data;
+
+    pthread_mutex_lock(&cache.lock);
+    bound = cache.stats.budget ? LZ4_compressBound((int) size) : 0;
+    pthread_mutex_unlock(&cache.lock);
+    if (!bound || size > LZ4_MAX_INPUT_SIZE)
+        return;
+
+    /* Compress without the lock; this is the expensive part */
+    data = malloc(bound);
+    if (!data)
+        return;
+    compressed_size = LZ4_compress_default((const char*) pixels, data,
+                                           (int) size, bound);
+    if (compressed_size <= 0) {
+        free(data);
+        return;
+    }
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        free(data);
+        return;
+    }
+    /* Give back the slack from the worst-case buffer */
+    entry->data = realloc(data, compressed_size);
+    if (!entry->data)
+        entry->data = data;
+    entry->compressed_size = compressed_size;
+    entry->key = *key;
+    entry->key.image_path = strdup(key->image_path);
+    entry->hash = key_hash(key);
+    if (!entry->key.image_path) {
+        free(entry->data);
+        free(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&cache.lock);
+    old = find_entry(key, entry->hash);
+    if (old)
+        drop_entry(old);
+    if ((size_t) compressed_size > cache.stats.budget) {
+        pthread_mutex_unlock(&cache.lock);
+        free((char*) entry->key.image_path);
+        free(entry->data);
+        free(entry);
+        return;
+    }
+    make_room(compressed_size);
+    push_entry(entry);
+    cache.stats.entries++;
+    cache.stats.compressed_bytes += compressed_size;
+    cache.stats.raw_bytes += size;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* See image_cache.h. */
+int image_cache_contains(const ImageKey *key)
+{
+    uint32_t hash = key_hash(key);
+    int found;
+
+    pthread_mutex_lock(&cache.lock);
+    found = find_entry(key, hash) != NULL;
+    pthread_mutex_unlock(&cache.lock);
+    return found;
+}
+
+/* See image_cache.h. */
+void image_cache_get_stats(ImageCacheStats *stats)
+{
+    pthread_mutex_lock(&cache.lock);
+    *stats = cache.stats;
+    pthread_mutex_unlock(&cache.lock);
+}
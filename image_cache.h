@@ -0,0 +1,72 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Everything that goes into a rendered screen image. The canvas is rendered
+ * before it's converted to the X visual, so images can be shared between any
+ * screens with the same geometry.
+ */
+typedef struct {
+    const char *image_path;
+
+    /** Modification time of the image file. */
+    struct timespec mtime;
+
+    /** WallpaperMode. */
+    int mode;
+    unsigned long background_color;
+
+    unsigned int width, height;
+} ImageKey;
+
+/** Check whether two keys are for the same rendered image. */
+int image_key_equal(const ImageKey *a, const ImageKey *b);
+
+/** Statistics for the image cache, reported in OWallpaperD.stats. */
+typedef struct {
+    /** Lookups which found an image and total time spent decompressing it. */
+    unsigned long hits;
+    double hit_time;
+
+    unsigned long misses;
+
+    /** Images dropped to stay within the memory budget. */
+    unsigned long evictions;
+
+    /** Number of cached images and their compressed and raw sizes. */
+    unsigned long entries;
+    size_t compressed_bytes;
+    size_t raw_bytes;
+
+    size_t budget;
+} ImageCacheStats;
+
+/**
+ * Set the memory budget for compressed images in bytes, evicting the least
+ * recently used images if it's exceeded. Zero disables the cache (the
+ * default).
+ */
+void image_cache_set_budget(size_t budget);
+
+/**
+ * Look up a rendered image and decompress it into a width * height ARGB
+ * buffer. The cache may be used from any thread.
+ * @return Zero on a hit, non-zero on a miss, in which case the contents of
+ * pixels are undefined.
+ */
+int image_cache_load(const ImageKey *key, uint32_t *pixels);
+
+/** Compress and store a rendered width * height ARGB image. */
+void image_cache_store(const ImageKey *key, const uint32_t *pixels);
+
+/** Check whether an image is cached without counting a hit or a miss. */
+int image_cache_contains(const ImageKey *key);
+
+/** Get a snapshot of the cache statistics. */
+void image_cache_get_stats(ImageCacheStats *stats);
+
+#endif /* IMAGE_CACHE_H */
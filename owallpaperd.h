@@ -1,7 +1,11 @@
 #include <Python.h>
 #include "structmember.h"
+#include <poll.h>
 
 #include "helper.h"
+#include "image_cache.h"
+#include "render_queue.h"
+#include "scale.h"
 
 /** Exception type for OWallpaperD errors */
 extern PyObject *OWallpaperDError;
@@ -9,26 +13,177 @@ extern PyObject *OWallpaperDError;
 /** OWallpaperD type */
 extern PyTypeObject OWallpaperDType;
 
+/** How the native event loop picks the wallpaper for a workspace */
+typedef enum {
+    POLICY_NONE,
+    POLICY_MODULO,
+    POLICY_TABLE,
+    POLICY_CALLABLE
+} PolicyKind;
+
+/** A slideshow cycling through wallpapers on one Xinerama screen. */
+typedef struct {
+    /** Tuple of Wallpaper objects, or NULL if there is no slideshow. */
+    PyObject *wallpapers;
+
+    /** Seconds between switches. */
+    double interval;
+
+    /** Index of the next wallpaper to show. */
+    Py_ssize_t next;
+
+    /** Monotonic time at which to show the next wallpaper. */
+    double deadline;
+
+    /** Running estimate of the time it takes to render a wallpaper. */
+    double render_estimate;
+
+    /** Set if the deadline passed before the next wallpaper was rendered. */
+    int late;
+
+    /** Number of wallpapers in a row which failed to render. */
+    Py_ssize_t failures;
+} Slideshow;
+
+/** Statistics reported by the stats attribute. */
+typedef struct {
+    /** Number of wallpapers rendered for a screen and total time taken. */
+    unsigned long renders;
+    double render_time;
+
+    /** Number of those renders done on a background thread. */
+    unsigned long background_renders;
+
+    /** Number of renders which failed. */
+    unsigned long render_errors;
+
+    /** Number of slideshow switches. */
+    unsigned long slideshow_switches;
+
+    /** Number of slideshow switches which happened after their deadline. */
+    unsigned long missed_deadlines;
+
+    /**
+     * Number of set_wallpaper() calls and total time until something was
+     * shown on the screen.
+     */
+    unsigned long switches;
+    double first_pixels_time;
+
+    /**
+     * Number of those switches which reached full quality and total time
+     * until they did. Progressive switches which were replaced before the
+     * full-quality render finished aren't counted.
+     */
+    unsigned long full_quality_switches;
+    double full_quality_time;
+} Stats;
+
+/** A progressive switch waiting for its full-quality render. */
+typedef struct {
+    /**
+     * Wallpaper being rendered, or NULL. This is only compared against, so we
+     * don't hold a reference; the render job does.
+     */
+    PyObject *wallpaper;
+
+    /** Preview shown in the meantime, or None. */
+    Pixmap preview;
+
+    /** Monotonic time when the switch started. */
+    double start;
+} Progressive;
+
+/**
+ * A rendered pixmap published by the previous daemon instance for us to adopt,
+ * along with the cache key it was rendered for.
+ */
+typedef struct {
+    /** The pixmap, or None once it has been adopted or freed. */
+    Pixmap pixmap;
+
+    /** Index of the connection which it was published on. */
+    Py_ssize_t connection;
+
+    /** Geometry of the Xinerama screen and depth of the pixmap. */
+    XineramaScreenInfo info;
+    unsigned int depth;
+
+    WallpaperMode mode;
+    unsigned long background_color;
+
+    /** Modification time of the image file. */
+    struct timespec mtime;
+
+    char *image_path;
+} HandoffPixmap;
+
+/**
+ * An X screen driven by the daemon, with its own connection. Its Xinerama
+ * screens take up a contiguous range of the daemon's screen indices.
+ */
+typedef struct {
+    Display *display;
+    int screen;
+
+    /** OWALLPAPERD_WORKSPACES atom on this display. */
+    Atom workspaces_atom;
+
+    /** Index of the first of our Xinerama screens on this X screen. */
+    Py_ssize_t first;
+
+    /** Number of Xinerama screens on this X screen. */
+    Py_ssize_t count;
+} Connection;
+
+/** A directory of wallpapers which is watched for changes. */
+typedef struct {
+    /** inotify watch descriptor, or -1 if the directory went away. */
+    int wd;
+
+    /** Path of the directory. */
+    char *path;
+
+    /** Keyword arguments for creating Wallpapers from the directory. */
+    PyObject *kwds;
+
+    /** Whether wallpapers from the directory are rendered lazily. */
+    int lazy;
+} WatchedDirectory;
+
 /**
  * Wallpaper-switching daemon object, encapsulating the state of each Xinerama
  * screen, including the dimensions of the screen, a desktop window for each
- * screen, and which workspace was on each screen the last time that we checked
+ * screen, and which workspace was on each screen the last time that we checked.
+ * The Xinerama screens of every X screen that we drive are numbered together.
  */
 typedef struct {
     PyObject_HEAD
 
-    /** X11 display. */
-    Display *display;
-
-    /** X11 screen. */
-    int screen;
+    /** Connection for each X screen. */
+    Connection *connections;
+    Py_ssize_t num_connections;
 
-    /** Number of Xinerama screens. */
+    /** Number of Xinerama screens on all of the X screens. */
     Py_ssize_t num_screens;
 
-    /** Info for each Xinerama screen. */
+    /** Info for each Xinerama screen, relative to its X screen. */
     XineramaScreenInfo *screens;
 
+    /** Index in connections of each Xinerama screen. */
+    Py_ssize_t *screen_connections;
+
+    /**
+     * Index of the slot in Wallpaper pixmaps used by each Xinerama screen.
+     * Xinerama screens of the same size on the same X screen share a slot, and
+     * so share pixmaps.
+     */
+    Py_ssize_t *slots;
+    Py_ssize_t num_slots;
+
+    /** First Xinerama screen using each slot. */
+    Py_ssize_t *slot_screens;
+
     /** Desktop window for each Xinerama screen. */
     Window *windows;
 
@@ -37,6 +192,72 @@ typedef struct {
 
     /** Python list of Wallpaper objects. */
     PyObject *wallpapers;
+
+    /** Pixmap currently set as the background of each desktop window. */
+    Pixmap *current_pixmaps;
+
+    /** Policy used by run() to pick wallpapers. */
+    PolicyKind policy;
+
+    /**
+     * Tuple of Wallpaper objects (or None) for POLICY_TABLE, indexed by
+     * workspace, or snapshot of wallpapers for POLICY_MODULO. It must not
+     * change while run() is executing.
+     */
+    PyObject *policy_table;
+
+    /** Callable for POLICY_CALLABLE. */
+    PyObject *policy_callable;
+
+    /** Non-zero while run() is executing. */
+    int running;
+
+    /** Non-zero while wait_for_workspace_change() is executing. */
+    int waiting;
+
+    /**
+     * Poll set for the X connections followed by the timer, the render queue,
+     * and the inotify instance, so that it doesn't have to be allocated
+     * without the GIL.
+     */
+    struct pollfd *pollfds;
+
+    /** Slideshow for each Xinerama screen. */
+    Slideshow *slideshows;
+
+    /** timerfd for slideshow deadlines. */
+    int timer_fd;
+
+    /** Background rendering threads. */
+    RenderQueue *render_queue;
+
+    /** inotify instance for watched directories. */
+    int inotify_fd;
+
+    /**
+     * Watched wallpaper directories. The array can grow whenever the GIL is
+     * released, but the directories themselves don't move.
+     */
+    WatchedDirectory **directories;
+    Py_ssize_t num_directories;
+
+    /** Progressive switch in progress on each Xinerama screen. */
+    Progressive *progressive;
+
+    /** Pixmaps published by the previous instance which may be adopted. */
+    HandoffPixmap *handoff;
+    Py_ssize_t num_handoff;
+
+    /** Set once handoff() has given our resources to the next instance. */
+    int handed_off;
+
+    /**
+     * Dict from path to the Wallpaper being rendered in the background for a
+     * new or modified file in a watched directory.
+     */
+    PyObject *loading;
+
+    Stats stats;
 } OWallpaperD;
 
 /** Wallpaper type */
@@ -44,20 +265,68 @@ extern PyTypeObject WallpaperType;
 
 /**
  * Wallpaper object, storing the pixmaps for the wallpaper. We store a pixmap
- * for each Xinerama screen.
+ * for each slot of the OWallpaperD, i.e., each size of Xinerama screen on each
+ * X screen.
  */
 typedef struct {
     PyObject_HEAD
 
-    /** X11 display. */
-    Display *display;
-
-    /** X11 screen. */
-    int screen;
+    /** Number of slots. */
+    Py_ssize_t num_slots;
 
-    /** Number of Xinerama screens. */
-    Py_ssize_t num_screens;
+    /** X11 display of each slot. */
+    Display **displays;
 
-    /** Pixmap for each Xinerama screen. */
+    /** Pixmap for each slot, or None if not rendered yet. */
     Pixmap *pixmaps;
+
+    /** Whether a background render is queued for each slot. */
+    char *pending;
+
+    /** Path of the image file. */
+    char *image_path;
+
+    /** Mode for rendering the wallpaper. */
+    WallpaperMode mode;
+
+    /** Background color on which to render the wallpaper. */
+    unsigned long background_color;
+
+    /** Modification time of the image file when the wallpaper was created. */
+    struct timespec mtime;
+
+    /**
+     * Whether to keep the rendered wallpaper only in the compressed image
+     * cache rather than as server pixmaps, which are freed once shown.
+     */
+    int cached;
 } Wallpaper;
+
+/** Connection of one of an OWallpaperD's Xinerama screens. */
+#define SCREEN_CONNECTION(owallpaperD, xinerama_screen) \
+    (&(owallpaperD)->connections[(owallpaperD)->screen_connections[ \
+        xinerama_screen]])
+
+/**
+ * Render a Wallpaper for a Xinerama screen if it hasn't been rendered yet.
+ * Must be called with the GIL held; it's released while rendering.
+ * @return Zero on success, an error code for set_render_error() on failure.
+ */
+int wallpaper_render(Wallpaper *wallpaper, OWallpaperD *owallpaperD,
+                     Py_ssize_t xinerama_screen);
+
+/**
+ * Check whether a Wallpaper's image for a Xinerama screen is in the image
+ * cache, so that it can be shown without rendering it from scratch.
+ */
+int wallpaper_in_cache(Wallpaper *wallpaper, OWallpaperD *owallpaperD,
+                       Py_ssize_t xinerama_screen);
+
+/** Set a Python exception for an error returned by create_wallpaper(). */
+void set_render_error(int error);
+
+/**
+ * Take any pixmaps for a Wallpaper which were published by the previous
+ * daemon instance, so that they don't have to be rendered.
+ */
+void adopt_handoff_pixmaps(OWallpaperD *owallpaperD, Wallpaper *wallpaper);
@@ -2,12 +2,58 @@
 
 PyObject *OWallpaperDError;
 
+static PyObject *owallpaperd_set_scale_threads(PyObject *self, PyObject *args)
+{
+    int num_threads;
+
+    if (!PyArg_ParseTuple(args, "i", &num_threads))
+        return NULL;
+
+    set_scale_threads(num_threads);
+    Py_RETURN_NONE;
+}
+
+static PyObject *owallpaperd_set_cache_budget(PyObject *self, PyObject *args)
+{
+    Py_ssize_t budget;
+
+    if (!PyArg_ParseTuple(args, "n", &budget))
+        return NULL;
+    if (budget < 0) {
+        PyErr_SetString(PyExc_ValueError, "budget must be non-negative");
+        return NULL;
+    }
+
+    image_cache_set_budget((size_t) budget);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef owallpaperd_methods[] = {
+    {"set_scale_threads",
+     (PyCFunction) owallpaperd_set_scale_threads, METH_VARARGS,
+"Set the number of threads used to scale a single wallpaper, or 0 to use one\n"
+"per CPU (the default). The rendered wallpapers are identical regardless."
+    },
+    {"set_cache_budget",
+     (PyCFunction) owallpaperd_set_cache_budget, METH_VARARGS,
+"Set the memory budget in bytes for the image cache, which keeps rendered\n"
+"wallpapers compressed with LZ4 so that they can be shown again without\n"
+"decoding and scaling the image. The least recently used images are evicted\n"
+"when it's full. 0 disables the cache (the default)."
+    },
+    {NULL}
+};
+
 static PyModuleDef owallpaperdmodule = {
     PyModuleDef_HEAD_INIT,
     "owallpaperd",
-    "Module for creating a wallpaper switching daemon.",
+    "Module for creating a wallpaper switching daemon.\n"
+    "\n"
+    "This enables Xlib's thread support, which only works if it's done before\n"
+    "any X display is opened, so import it before any other module which uses\n"
+    "Xlib (e.g., a GUI toolkit).",
     -1,
-    NULL, NULL, NULL, NULL, NULL
+    owallpaperd_methods, NULL, NULL, NULL, NULL
 };
 
 PyMODINIT_FUNC
@@ -15,6 +61,22 @@ PyInit_owallpaperd(void)
 {
     PyObject* m;
 
+    /*
+     * The render threads and any other Python threads use the same displays
+     * concurrently. Xlib only honors this if it's called before any display
+     * is opened, and there's no way to check whether another module already
+     * opened one, so owallpaperd has to be imported first (see the module
+     * docstring)
+     */
+    if (!XInitThreads()) {
+        PyErr_SetString(PyExc_ImportError,
+                        "could not initialize Xlib thread support");
+        return NULL;
+    }
+
+    /* Installed once, since swapping handlers would race with other threads */
+    init_x_error_handler();
+
     if (PyType_Ready(&OWallpaperDType) < 0)
         return NULL;
 
@@ -1,305 +1,2930 @@
+#include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include "owallpaperd.h"
 
+/** Minimum time before a slideshow deadline to start rendering. */
+#define SLIDESHOW_MIN_LEAD 1.0
+
+/** Events returned by poll_events(). */
+#define EVENT_X 0x1
+#define EVENT_TIMER 0x2
+#define EVENT_RENDER 0x4
+#define EVENT_WATCH 0x8
+
+/** Root window property on which handoff() publishes our resources. */
+#define HANDOFF_PROPERTY "OWALLPAPERD_HANDOFF"
+
+/** Error for an entry of the displays argument of the wrong type. */
+#define DISPLAYS_ITEM_ERROR \
+    "displays must contain display names or (display name, screen) tuples"
+
+/** Free the published pixmaps which nothing adopted. */
+static void release_handoff(OWallpaperD *self)
+{
+    Py_ssize_t i, j;
+
+    for (i = 0; i < self->num_handoff; ++i) {
+        Pixmap pixmap = self->handoff[i].pixmap;
+
+        if (pixmap) {
+            Connection *connection =
+                &self->connections[self->handoff[i].connection];
+
+            /* The server keeps the window background alive on its own */
+            for (j = connection->first;
+                 j < connection->first + connection->count; ++j) {
+                if (self->current_pixmaps && self->current_pixmaps[j] == pixmap)
+                    self->current_pixmaps[j] = None;
+            }
+            XFreePixmap(connection->display, pixmap);
+        }
+        free(self->handoff[i].image_path);
+    }
+    if (self->handoff)
+        PyMem_Free(self->handoff);
+    self->handoff = NULL;
+    self->num_handoff = 0;
+}
+
+/* See owallpaperd.h. */
+void adopt_handoff_pixmaps(OWallpaperD *self, Wallpaper *wallpaper)
+{
+    Py_ssize_t i, j;
+
+    /* Without a modification time we can't tell whether the file changed */
+    if (!wallpaper->mtime.tv_sec && !wallpaper->mtime.tv_nsec)
+        return;
+
+    for (i = 0; i < self->num_slots; ++i) {
+        Py_ssize_t xinerama_screen = self->slot_screens[i];
+        XineramaScreenInfo *info = &self->screens[xinerama_screen];
+        Connection *connection = SCREEN_CONNECTION(self, xinerama_screen);
+
+        for (j = 0; j < self->num_handoff; ++j) {
+            HandoffPixmap *handoff = &self->handoff[j];
+
+            if (handoff->pixmap && !wallpaper->pixmaps[i] &&
+                handoff->connection == self->screen_connections[
+                    xinerama_screen] &&
+                handoff->info.width == info->width &&
+                handoff->info.height == info->height &&
+                handoff->depth ==
+                    (unsigned int) DefaultDepth(connection->display,
+                                                connection->screen) &&
+                handoff->mode == wallpaper->mode &&
+                handoff->background_color == wallpaper->background_color &&
+                handoff->mtime.tv_sec == wallpaper->mtime.tv_sec &&
+                handoff->mtime.tv_nsec == wallpaper->mtime.tv_nsec &&
+                strcmp(handoff->image_path, wallpaper->image_path) == 0) {
+                wallpaper->pixmaps[i] = handoff->pixmap;
+                handoff->pixmap = None;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Read the resource listing which a previous instance's handoff() published on
+ * one of its desktop windows, deleting it. Only a window which is still one of
+ * our desktop windows is trusted, since anyone can set the root property
+ * pointing to it.
+ * @return The listing, to be freed with XFree(), or NULL.
+ */
+static char *read_handoff_listing(Display *display, Window window,
+                                  Atom property)
+{
+    XErrorTrap trap;
+    Atom r_type;
+    int r_format, status;
+    unsigned long actual, left;
+    char *data = NULL;
+
+    if (!is_desktop_window(display, window))
+        return NULL;
+
+    /* The window may be destroyed at any time */
+    trap_x_errors(display, &trap);
+    status = XGetWindowProperty(display, window, property, 0L, 0x1fffffffL,
+                                True, XA_STRING, &r_type, &r_format, &actual,
+                                &left, (unsigned char**) &data);
+    if (untrap_x_errors(&trap) || status != Success)
+        return NULL;
+    if (data && (r_type != XA_STRING || r_format != 8)) {
+        XFree(data);
+        data = NULL;
+    }
+    return data;
+}
+
+/**
+ * Get the size and depth of a drawable, without triggering the X error handler
+ * if it doesn't exist.
+ * @return Non-zero if it exists.
+ */
+static int get_drawable_geometry(Display *display, Drawable drawable,
+                                 unsigned int *width, unsigned int *height,
+                                 unsigned int *depth)
+{
+    XErrorTrap trap;
+    Window root;
+    int x, y;
+    unsigned int border_width;
+    Status status;
+
+    trap_x_errors(display, &trap);
+    status = XGetGeometry(display, drawable, &root, &x, &y, width, height,
+                          &border_width, depth);
+    return !untrap_x_errors(&trap) && status;
+}
+
+/**
+ * Take the resources published by the previous instance's handoff() on an X
+ * screen. The root window property names the desktop windows holding the
+ * listings; only windows which are still our desktop windows are trusted, as
+ * are only the pixmaps listed by them which still exist with the listed size
+ * and depth. Desktop windows covering the same Xinerama screens are adopted
+ * into self->windows (which must be zeroed) so that the old wallpaper stays
+ * up, and the rest are destroyed. Published pixmaps are kept for
+ * adopt_handoff_pixmaps().
+ * @param index Index of the connection.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int take_handoff(OWallpaperD *self, Py_ssize_t index)
+{
+    Connection *connection = &self->connections[index];
+    Display *display = connection->display;
+    Atom property, r_type;
+    int r_format;
+    unsigned long actual, left, k;
+    Window *listings = NULL;
+    char *data, *line, *next;
+    Py_ssize_t i, end = connection->first + connection->count;
+
+    property = XInternAtom(display, HANDOFF_PROPERTY, False);
+    if (XGetWindowProperty(display, RootWindow(display, connection->screen),
+                           property, 0L, 0x1fffffffL, True, AnyPropertyType,
+                           &r_type, &r_format, &actual, &left,
+                           (unsigned char**) &listings) != Success ||
+        !listings)
+        return 0;
+    if (r_type != XA_WINDOW || r_format != 32) {
+        XFree(listings);
+        return 0;
+    }
+
+    for (k = 0; k < actual; ++k) {
+        data = read_handoff_listing(display, listings[k], property);
+        if (!data)
+            continue;
+
+        for (line = data; line && *line; line = next) {
+            HandoffPixmap handoff;
+            Window window;
+            Pixmap current;
+            int x, y, mode, path_offset;
+            unsigned int width, height, depth, actual_width, actual_height;
+            long mtime_sec, mtime_nsec;
+
+            next = strchr(line, '\n');
+            if (next)
+                *next++ = '\0';
+
+            if (sscanf(line, "W %lx %lx %d %d %u %u", &window, &current, &x,
+                       &y, &width, &height) == 6) {
+                /* Never touch a window which isn't one of ours */
+                if (!is_desktop_window(display, window))
+                    continue;
+
+                /* Adopt the old window if it covers one of our screens */
+                for (i = connection->first; i < end; ++i) {
+                    XineramaScreenInfo *info = &self->screens[i];
+                    if (!self->windows[i] && info->x_org == x &&
+                        info->y_org == y && info->width == (int) width &&
+                        info->height == (int) height)
+                        break;
+                }
+                if (i < end) {
+                    self->windows[i] = window;
+                    self->current_pixmaps[i] = current;
+                } else
+                    XDestroyWindow(display, window);
+            } else if (sscanf(line, "P %lx %d %d %u %u %u %d %lx %ld.%ld%n",
+                              &handoff.pixmap, &x, &y, &width, &height,
+                              &handoff.depth, &mode,
+                              &handoff.background_color, &mtime_sec,
+                              &mtime_nsec, &path_offset) == 10 &&
+                       line[path_offset] == ' ') {
+                HandoffPixmap *handoffs;
+
+                if (!get_drawable_geometry(display, handoff.pixmap,
+                                           &actual_width, &actual_height,
+                                           &depth) ||
+                    actual_width != width || actual_height != height ||
+                    depth != handoff.depth)
+                    continue;
+                handoff.connection = index;
+                handoff.info.x_org = x;
+                handoff.info.y_org = y;
+                handoff.info.width = width;
+                handoff.info.height = height;
+                handoff.mode = mode;
+                handoff.mtime.tv_sec = mtime_sec;
+                handoff.mtime.tv_nsec = mtime_nsec;
+                /* Skip only the separator; the path may start with spaces */
+                handoff.image_path = strdup(line + path_offset + 1);
+
+                handoffs = PyMem_Realloc(self->handoff,
+                                         sizeof(HandoffPixmap) *
+                                         (self->num_handoff + 1));
+                if (!handoff.image_path || !handoffs) {
+                    XFreePixmap(display, handoff.pixmap);
+                    free(handoff.image_path);
+                    XFree(data);
+                    XFree(listings);
+                    PyErr_NoMemory();
+                    return -1;
+                }
+                self->handoff = handoffs;
+                self->handoff[self->num_handoff++] = handoff;
+            }
+        }
+        XFree(data);
+    }
+
+    XFree(listings);
+    return 0;
+}
+
+/**
+ * Append a line to a handoff property buffer.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int handoff_append(char **buf, size_t *len, size_t *capacity,
+                          const char *line)
+{
+    size_t line_len = strlen(line);
+
+    if (*len + line_len + 1 > *capacity) {
+        size_t new_capacity = 2 * (*len + line_len + 1);
+        char *new_buf = PyMem_Realloc(*buf, new_capacity);
+        if (!new_buf) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *buf = new_buf;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *len, line, line_len + 1);
+    *len += line_len;
+    return 0;
+}
+
+/** Flush the output buffers of all of the X connections. */
+static void flush_connections(OWallpaperD *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->num_connections; ++i)
+        XFlush(self->connections[i].display);
+}
+
+/**
+ * Build the listing of the resources on an X screen for handoff(): the desktop
+ * windows and what they're showing, and the rendered pixmaps, keyed by
+ * everything that went into rendering them.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int build_handoff_listing(OWallpaperD *self, Py_ssize_t index,
+                                 char **buf, size_t *len)
+{
+    Connection *connection = &self->connections[index];
+    Display *display = connection->display;
+    size_t capacity = 0;
+    char line[128];
+    Py_ssize_t i, j;
+
+    *buf = NULL;
+    *len = 0;
+    for (i = connection->first; i < connection->first + connection->count;
+         ++i) {
+        XineramaScreenInfo *info = &self->screens[i];
+        snprintf(line, sizeof(line), "W %lx %lx %d %d %d %d\n",
+                 self->windows[i], self->current_pixmaps[i], info->x_org,
+                 info->y_org, info->width, info->height);
+        if (handoff_append(buf, len, &capacity, line))
+            return -1;
+    }
+
+    for (i = 0; i < PyList_GET_SIZE(self->wallpapers); ++i) {
+        Wallpaper *wallpaper;
+
+        wallpaper = (Wallpaper*) PyList_GET_ITEM(self->wallpapers, i);
+        if (!PyObject_TypeCheck(wallpaper, &WallpaperType) ||
+            strchr(wallpaper->image_path, '\n'))
+            continue;
+
+        for (j = 0; j < wallpaper->num_slots; ++j) {
+            Py_ssize_t xinerama_screen = self->slot_screens[j];
+            XineramaScreenInfo *info = &self->screens[xinerama_screen];
+
+            if (!wallpaper->pixmaps[j] ||
+                self->screen_connections[xinerama_screen] != index)
+                continue;
+            snprintf(line, sizeof(line),
+                     "P %lx %d %d %d %d %d %d %lx %ld.%09ld ",
+                     wallpaper->pixmaps[j], info->x_org, info->y_org,
+                     info->width, info->height,
+                     DefaultDepth(display, connection->screen),
+                     wallpaper->mode, wallpaper->background_color,
+                     (long) wallpaper->mtime.tv_sec,
+                     (long) wallpaper->mtime.tv_nsec);
+            if (handoff_append(buf, len, &capacity, line) ||
+                handoff_append(buf, len, &capacity, wallpaper->image_path) ||
+                handoff_append(buf, len, &capacity, "\n"))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static PyObject *OWallpaperD_handoff(OWallpaperD *self)
+{
+    char **bufs;
+    size_t *lens;
+    Py_ssize_t c, i, j;
+    long published = 0;
+    PyObject *ret = NULL;
+
+    if (self->running) {
+        PyErr_SetString(OWallpaperDError, "cannot hand off while running");
+        return NULL;
+    }
+    if (self->handed_off) {
+        PyErr_SetString(OWallpaperDError, "already handed off");
+        return NULL;
+    }
+
+    /* Build every listing before publishing anything, since that can fail */
+    bufs = PyMem_New(char*, self->num_connections);
+    lens = PyMem_New(size_t, self->num_connections);
+    if (!bufs || !lens) {
+        PyMem_Free(bufs);
+        PyMem_Free(lens);
+        return PyErr_NoMemory();
+    }
+    memset(bufs, 0, sizeof(char*) * self->num_connections);
+    for (c = 0; c < self->num_connections; ++c) {
+        if (build_handoff_listing(self, c, &bufs[c], &lens[c]))
+            goto out;
+    }
+
+    /*
+     * Each X screen's listing goes on its first desktop window, which the
+     * next instance can check is ours, and the root window property points to
+     * it
+     */
+    for (c = 0; c < self->num_connections; ++c) {
+        Connection *connection = &self->connections[c];
+        Display *display = connection->display;
+        Window listing = self->windows[connection->first];
+        Atom property = XInternAtom(display, HANDOFF_PROPERTY, False);
+
+        /*
+         * Keep everything around after we disconnect. This is only done
+         * along with publishing it, since nothing would free resources which
+         * are retained but not published
+         */
+        XSetCloseDownMode(display, RetainPermanent);
+        XChangeProperty(display, listing, property, XA_STRING, 8,
+                        PropModeReplace, (unsigned char*) bufs[c],
+                        (int) lens[c]);
+        XChangeProperty(display, RootWindow(display, connection->screen),
+                        property, XA_WINDOW, 32, PropModeReplace,
+                        (unsigned char*) &listing, 1);
+        XSync(display, False);
+    }
+    self->handed_off = 1;
+
+    /* The published pixmaps belong to the next instance now */
+    for (i = 0; i < PyList_GET_SIZE(self->wallpapers); ++i) {
+        Wallpaper *wallpaper;
+
+        wallpaper = (Wallpaper*) PyList_GET_ITEM(self->wallpapers, i);
+        if (!PyObject_TypeCheck(wallpaper, &WallpaperType) ||
+            strchr(wallpaper->image_path, '\n'))
+            continue;
+        for (j = 0; j < wallpaper->num_slots; ++j) {
+            if (wallpaper->pixmaps[j]) {
+                wallpaper->pixmaps[j] = None;
+                published++;
+            }
+        }
+    }
+    ret = PyLong_FromLong(published);
+
+out:
+    for (c = 0; c < self->num_connections; ++c)
+        PyMem_Free(bufs[c]);
+    PyMem_Free(bufs);
+    PyMem_Free(lens);
+    return ret;
+}
+
+static PyObject *OWallpaperD_release_handoff(OWallpaperD *self)
+{
+    release_handoff(self);
+    flush_connections(self);
+    Py_RETURN_NONE;
+}
+
 static void OWallpaperD_dealloc(OWallpaperD *self)
 {
     Py_ssize_t i;
-    if (self->screens)
-        XFree(self->screens);
-    for (i = 0; i < self->num_screens; ++i)
-        XDestroyWindow(self->display, self->windows[i]);
-    if (self->windows)
-        PyMem_Free(self->windows);
-    if (self->workspaces)
-        XFree(self->workspaces);
-    if (self->display)
-        XCloseDisplay(self->display);
-    Py_XDECREF(self->wallpapers);
-    Py_TYPE(self)->tp_free((PyObject*) self);
+    if (self->render_queue) {
+        RenderJob *job = render_queue_destroy(self->render_queue);
+        while (job) {
+            RenderJob *next = job->next;
+            if (!job->error)
+                XFreePixmap(job->display, job->pixmap);
+            ((Wallpaper*) job->data)->pending[self->slots[job->index]] = 0;
+            Py_DECREF((PyObject*) job->data);
+            render_job_free(job);
+            job = next;
+        }
+        PyMem_Free(self->render_queue);
+    }
+    if (self->progressive) {
+        for (i = 0; i < self->num_screens; ++i) {
+            if (self->progressive[i].preview)
+                XFreePixmap(SCREEN_CONNECTION(self, i)->display,
+                            self->progressive[i].preview);
+        }
+        PyMem_Free(self->progressive);
+    }
+    if (self->slideshows) {
+        for (i = 0; i < self->num_screens; ++i)
+            Py_XDECREF(self->slideshows[i].wallpapers);
+        PyMem_Free(self->slideshows);
+    }
+    if (self->timer_fd > 0)
+        close(self->timer_fd);
+    if (self->inotify_fd > 0)
+        close(self->inotify_fd);
+    for (i = 0; i < self->num_directories; ++i) {
+        free(self->directories[i]->path);
+        Py_DECREF(self->directories[i]->kwds);
+        PyMem_Free(self->directories[i]);
+    }
+    if (self->directories)
+        PyMem_Free(self->directories);
+    Py_XDECREF(self->loading);
+
+    /* Wallpapers free their pixmaps, so drop them before closing displays */
+    Py_XDECREF(self->wallpapers);
+    Py_XDECREF(self->policy_table);
+    Py_XDECREF(self->policy_callable);
+    release_handoff(self);
+
+    if (self->windows) {
+        /* After a handoff, the next instance takes over the windows */
+        for (i = 0; i < self->num_screens && !self->handed_off; ++i) {
+            if (self->windows[i])
+                XDestroyWindow(SCREEN_CONNECTION(self, i)->display,
+                               self->windows[i]);
+        }
+        PyMem_Free(self->windows);
+    }
+    if (self->screens)
+        PyMem_Free(self->screens);
+    if (self->screen_connections)
+        PyMem_Free(self->screen_connections);
+    if (self->slots)
+        PyMem_Free(self->slots);
+    if (self->slot_screens)
+        PyMem_Free(self->slot_screens);
+    if (self->workspaces)
+        PyMem_Free(self->workspaces);
+    if (self->current_pixmaps)
+        PyMem_Free(self->current_pixmaps);
+    if (self->pollfds)
+        PyMem_Free(self->pollfds);
+    if (self->connections) {
+        for (i = 0; i < self->num_connections; ++i)
+            XCloseDisplay(self->connections[i].display);
+        PyMem_Free(self->connections);
+    }
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+/**
+ * Open a connection to an X screen and add its Xinerama screens to
+ * self->screens. If Xinerama isn't active (e.g., on a multi-head setup with a
+ * separate X screen per monitor), the whole X screen is used as a single
+ * Xinerama screen.
+ * @param display_name Display to open, or NULL for the default display.
+ * @param screen_num X screen, or -1 for the display's default screen.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int open_connection(OWallpaperD *self, const char *display_name,
+                           int screen_num)
+{
+    Connection *connection;
+    XineramaScreenInfo *info, *screens;
+    Display *display;
+    int num_screens;
+
+    display = XOpenDisplay(display_name);
+    if (!display) {
+        if (display_name)
+            PyErr_Format(OWallpaperDError, "could not open display %s",
+                         display_name);
+        else
+            PyErr_SetString(OWallpaperDError, "could not open default display");
+        return -1;
+    }
+
+    connection = &self->connections[self->num_connections++];
+    connection->display = display;
+    if (screen_num == -1)
+        connection->screen = DefaultScreen(display);
+    else
+        connection->screen = screen_num;
+    if (connection->screen < 0 || connection->screen >= ScreenCount(display)) {
+        PyErr_Format(OWallpaperDError, "display %s has no screen %d",
+                     DisplayString(display), connection->screen);
+        return -1;
+    }
+
+    connection->workspaces_atom =
+        XInternAtom(display, "OWALLPAPERD_WORKSPACES", False);
+    XSelectInput(display, RootWindow(display, connection->screen),
+                 PropertyChangeMask);
+
+    /* Get info for Xinerama screens */
+    info = XineramaQueryScreens(display, &num_screens);
+    if (!info)
+        num_screens = 1;
+
+    screens = PyMem_Realloc(self->screens, sizeof(XineramaScreenInfo) *
+                            (self->num_screens + num_screens));
+    if (!screens) {
+        if (info)
+            XFree(info);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->screens = screens;
+
+    screens += self->num_screens;
+    if (info) {
+        memcpy(screens, info, sizeof(XineramaScreenInfo) * num_screens);
+        XFree(info);
+    } else {
+        screens->screen_number = 0;
+        screens->x_org = 0;
+        screens->y_org = 0;
+        screens->width = DisplayWidth(display, connection->screen);
+        screens->height = DisplayHeight(display, connection->screen);
+    }
+
+    connection->first = self->num_screens;
+    connection->count = num_screens;
+    self->num_screens += num_screens;
+    return 0;
+}
+
+/**
+ * Open the connections for the displays argument: a sequence of display names
+ * or (display name, screen) tuples.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int open_connections(OWallpaperD *self, PyObject *displays)
+{
+    PyObject *sequence;
+    Py_ssize_t i, num_displays;
+
+    sequence = PySequence_Fast(displays, "displays must be a sequence");
+    if (!sequence)
+        return -1;
+    num_displays = PySequence_Fast_GET_SIZE(sequence);
+    if (num_displays == 0) {
+        PyErr_SetString(PyExc_ValueError, "displays must not be empty");
+        goto err;
+    }
+
+    self->connections = PyMem_New(Connection, num_displays);
+    if (!self->connections) {
+        PyErr_NoMemory();
+        goto err;
+    }
+
+    for (i = 0; i < num_displays; ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(sequence, i);
+        const char *display_name;
+        int screen_num = -1;
+
+        if (PyUnicode_Check(item)) {
+            display_name = PyUnicode_AsUTF8(item);
+            if (!display_name)
+                goto err;
+        } else if (!PyTuple_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, DISPLAYS_ITEM_ERROR);
+            goto err;
+        } else if (!PyArg_ParseTuple(item, "zi;" DISPLAYS_ITEM_ERROR,
+                                     &display_name, &screen_num))
+            goto err;
+
+        if (open_connection(self, display_name, screen_num))
+            goto err;
+    }
+
+    Py_DECREF(sequence);
+    return 0;
+
+err:
+    Py_DECREF(sequence);
+    return -1;
+}
+
+static int OWallpaperD_init(OWallpaperD *self, PyObject *args, PyObject *kwds)
+{
+    const char *display_name = NULL;
+    int screen_num = -1;
+    PyObject *displays = NULL;
+    Py_ssize_t i, j;
+
+    static char *kwlist[] = {"display_name", "screen", "displays", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|siO", kwlist,
+                                     &display_name, &screen_num, &displays))
+        return -1;
+
+    /* Initialize X */
+    if (displays && displays != Py_None) {
+        if (display_name || screen_num != -1) {
+            PyErr_SetString(PyExc_TypeError,
+                            "displays can't be combined with display_name "
+                            "or screen");
+            return -1;
+        }
+        if (open_connections(self, displays))
+            return -1;
+    } else {
+        self->connections = PyMem_New(Connection, 1);
+        if (!self->connections) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (open_connection(self, display_name, screen_num))
+            return -1;
+    }
+
+    /*
+     * Number the Xinerama screens' connections and slots. Screens of the same
+     * size on the same X screen can share pixmaps, so they get the same slot
+     */
+    self->screen_connections = PyMem_New(Py_ssize_t, self->num_screens);
+    self->slots = PyMem_New(Py_ssize_t, self->num_screens);
+    self->slot_screens = PyMem_New(Py_ssize_t, self->num_screens);
+    if (!self->screen_connections || !self->slots || !self->slot_screens) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < self->num_connections; ++i) {
+        Connection *connection = &self->connections[i];
+        for (j = 0; j < connection->count; ++j)
+            self->screen_connections[connection->first + j] = i;
+    }
+    for (i = 0; i < self->num_screens; ++i) {
+        for (j = 0; j < i; ++j) {
+            if (self->screen_connections[j] == self->screen_connections[i] &&
+                self->screens[j].width == self->screens[i].width &&
+                self->screens[j].height == self->screens[i].height)
+                break;
+        }
+        if (j < i)
+            self->slots[i] = self->slots[j];
+        else {
+            self->slots[i] = self->num_slots;
+            self->slot_screens[self->num_slots++] = i;
+        }
+    }
+
+    self->current_pixmaps = PyMem_New(Pixmap, self->num_screens);
+    if (!self->current_pixmaps) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->current_pixmaps, 0, sizeof(Pixmap) * self->num_screens);
+
+    self->windows = PyMem_New(Window, self->num_screens);
+    if (!self->windows) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->windows, 0, sizeof(Window) * self->num_screens);
+
+    /*
+     * If the previous instance handed off to us, take over its desktop windows
+     * and rendered pixmaps
+     */
+    for (i = 0; i < self->num_connections; ++i) {
+        if (take_handoff(self, i))
+            return -1;
+    }
+
+    /* Create the rest of the desktop windows and map them */
+    for (i = 0; i < self->num_screens; ++i) {
+        Connection *connection = SCREEN_CONNECTION(self, i);
+        XineramaScreenInfo *info = &self->screens[i];
+        if (!self->windows[i])
+            self->windows[i] = create_desktop_window(connection->display,
+                                                     connection->screen, info);
+    }
+    for (i = 0; i < self->num_screens; ++i)
+        XMapWindow(SCREEN_CONNECTION(self, i)->display, self->windows[i]);
+
+    /* Allocate and initialize array for workspaces */
+    self->workspaces = PyMem_New(long, self->num_screens);
+    if (!self->workspaces) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i < self->num_screens; ++i)
+        self->workspaces[i] = -1;
+
+    self->progressive = PyMem_New(Progressive, self->num_screens);
+    if (!self->progressive) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->progressive, 0, sizeof(Progressive) * self->num_screens);
+
+    /* Set up slideshows and background rendering */
+    self->slideshows = PyMem_New(Slideshow, self->num_screens);
+    if (!self->slideshows) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->slideshows, 0, sizeof(Slideshow) * self->num_screens);
+
+    self->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_CLOEXEC | TFD_NONBLOCK);
+    if (self->timer_fd == -1) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    self->pollfds = PyMem_New(struct pollfd, self->num_connections + 3);
+    if (!self->pollfds) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    self->render_queue = PyMem_New(RenderQueue, 1);
+    if (!self->render_queue) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    errno = render_queue_init(self->render_queue,
+                              (int) sysconf(_SC_NPROCESSORS_ONLN));
+    if (errno) {
+        PyMem_Free(self->render_queue);
+        self->render_queue = NULL;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    /* Create empty list of wallpapers */
+    self->wallpapers = PyList_New(0);
+    if (!self->wallpapers)
+        return -1;
+
+    self->loading = PyDict_New();
+    if (!self->loading)
+        return -1;
+
+    return 0;
+}
+
+static PyObject *OWallpaperD_getwallpapers(OWallpaperD *self, PyObject *value,
+                                           void *closure)
+{
+    Py_INCREF(self->wallpapers);
+    return self->wallpapers;
+}
+
+static PyObject *OWallpaperD_getnum_screens(OWallpaperD *self, PyObject *value,
+                                            void *closure)
+{
+    return PyLong_FromSsize_t(self->num_screens);
+}
+
+static PyObject *OWallpaperD_getstats(OWallpaperD *self, PyObject *value,
+                                      void *closure)
+{
+    Stats *stats = &self->stats;
+    ImageCacheStats cache;
+
+    image_cache_get_stats(&cache);
+    return Py_BuildValue("{s:k,s:d,s:k,s:k,s:k,s:k,s:k,s:d,s:k,s:d,"
+                         "s:k,s:k,s:d,s:k,s:k,s:n,s:n,s:d,s:n}",
+                         "renders", stats->renders,
+                         "render_time", stats->render_time,
+                         "background_renders", stats->background_renders,
+                         "render_errors", stats->render_errors,
+                         "slideshow_switches", stats->slideshow_switches,
+                         "missed_deadlines", stats->missed_deadlines,
+                         "switches", stats->switches,
+                         "time_to_first_pixels", stats->first_pixels_time,
+                         "full_quality_switches",
+                         stats->full_quality_switches,
+                         "time_to_full_quality", stats->full_quality_time,
+                         "cache_hits", cache.hits,
+                         "cache_misses", cache.misses,
+                         "cache_hit_time", cache.hit_time,
+                         "cache_evictions", cache.evictions,
+                         "cache_entries", cache.entries,
+                         "cache_bytes", (Py_ssize_t) cache.compressed_bytes,
+                         "cache_raw_bytes", (Py_ssize_t) cache.raw_bytes,
+                         "cache_compression_ratio",
+                         cache.compressed_bytes ?
+                         (double) cache.raw_bytes / cache.compressed_bytes :
+                         0.0,
+                         "cache_budget", (Py_ssize_t) cache.budget);
+}
+
+static PyGetSetDef OWallpaperD_getset[] = {
+    {"wallpapers",
+     (getter) OWallpaperD_getwallpapers, NULL,
+     "List of currently loaded wallpapers.", NULL},
+    {"num_screens",
+     (getter) OWallpaperD_getnum_screens, NULL,
+     "Number of Xinerama screens.", NULL},
+    {"stats",
+     (getter) OWallpaperD_getstats, NULL,
+     "Dictionary of rendering, slideshow, and image cache statistics. The\n"
+     "cache_* entries are shared by all OWallpaperD objects.", NULL},
+    {NULL}
+};
+
+/**
+ * Fetch the workspaces from the root window of each X screen and update
+ * self->workspaces. Must be called with the GIL held.
+ * @param changed If not NULL, set to whether the workspace changed for each
+ * Xinerama screen.
+ * @return 1 if the workspace changed on any screen, 0 if not, -1 if the
+ * workspaces could not be read on any X screen.
+ */
+static int update_workspaces(OWallpaperD *self, char *changed)
+{
+    long *workspaces;
+    Py_ssize_t c, i;
+    int any_changed = 0, any_read = 0;
+
+    for (c = 0; c < self->num_connections; ++c) {
+        Connection *connection = &self->connections[c];
+
+        workspaces = get_workspaces(connection->display, connection->screen,
+                                    connection->count);
+        for (i = 0; i < connection->count; ++i) {
+            Py_ssize_t xinerama_screen = connection->first + i;
+            int screen_changed;
+
+            /* Leave X screens whose window manager isn't ready alone */
+            screen_changed = workspaces &&
+                             workspaces[i] != self->workspaces[xinerama_screen];
+            if (screen_changed) {
+                any_changed = 1;
+                self->workspaces[xinerama_screen] = workspaces[i];
+            }
+            if (changed)
+                changed[xinerama_screen] = screen_changed;
+        }
+        if (workspaces) {
+            any_read = 1;
+            XFree(workspaces);
+        }
+    }
+    return any_read ? any_changed : -1;
+}
+
+/** Milliseconds from now until the given CLOCK_MONOTONIC deadline. */
+static int ms_until(const struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+         (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int) ms : 0;
+}
+
+/** Set a CLOCK_MONOTONIC deadline the given milliseconds from now. */
+static void deadline_after(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Convert a debounce window from seconds to milliseconds.
+ * @return The window in milliseconds, or -1 with an exception set if it's
+ * negative, not finite, or too long.
+ */
+static int debounce_ms(double debounce)
+{
+    if (!isfinite(debounce) || debounce < 0.0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "debounce must be a non-negative number of seconds");
+        return -1;
+    }
+    if (debounce > INT_MAX / 1000) {
+        PyErr_Format(PyExc_ValueError, "debounce must be at most %d seconds",
+                     INT_MAX / 1000);
+        return -1;
+    }
+    return (int) (debounce * 1000);
+}
+
+/**
+ * Coalesce a burst of workspace changes after one has been received: keep
+ * draining events until no workspace change has arrived for the debounce
+ * window, counting from the one just received, so that the property only has
+ * to be fetched once for the final state. Other events are discarded. This
+ * doesn't touch any Python state, so it may be called without the GIL.
+ * @param atom The OWALLPAPERD_WORKSPACES atom.
+ * @param debounce Debounce window in milliseconds, or zero to only drain the
+ * events which are already pending.
+ * @return Zero on success, -1 if interrupted by a signal.
+ */
+static int coalesce_workspace_events(Display *display, Atom atom, int debounce)
+{
+    struct pollfd pollfd;
+    struct timespec deadline;
+    XEvent event;
+    int timeout;
+
+    pollfd.fd = ConnectionNumber(display);
+    pollfd.events = POLLIN;
+
+    /*
+     * The caller has just received a workspace change, so the window starts
+     * now; the next change of a burst is usually still on its way
+     */
+    deadline_after(&deadline, debounce);
+    for (;;) {
+        while (XPending(display)) {
+            XNextEvent(display, &event);
+            /* Restart the debounce window */
+            if (event.type == PropertyNotify &&
+                event.xproperty.atom == atom)
+                deadline_after(&deadline, debounce);
+        }
+
+        timeout = ms_until(&deadline);
+        if (timeout == 0)
+            return 0;
+        if (poll(&pollfd, 1, timeout) == -1 && errno == EINTR)
+            return -1;
+    }
+}
+
+static PyObject *OWallpaperD_add_wallpaper(OWallpaperD *self, PyObject *args,
+                                           PyObject *kwds)
+{
+    PyObject *wallpaper;
+    Py_ssize_t num_args;
+    PyObject *new_args = NULL;
+    Py_ssize_t i;
+    int success = 1;
+
+    num_args = PyTuple_GET_SIZE(args) + 1;
+    new_args = PyTuple_New(num_args);
+
+    if (!new_args) {
+        success = 0;
+        goto out;
+    }
+
+    Py_INCREF(self);
+    PyTuple_SET_ITEM(new_args, 0, (PyObject*) self);
+    for (i = 1; i < num_args; ++i) {
+        PyObject *arg = PyTuple_GET_ITEM(args, i - 1);
+        Py_INCREF(arg);
+        PyTuple_SET_ITEM(new_args, i, arg);
+    }
+
+    wallpaper = PyObject_Call((PyObject*) &WallpaperType, new_args, kwds);
+    if (!wallpaper) {
+        success = 0;
+        goto out;
+    }
+
+    if (PyList_Append(self->wallpapers, wallpaper) == -1) {
+        success = 0;
+        goto out;
+    }
+
+out:
+    Py_XDECREF(new_args);
+    if (success)
+        return wallpaper;
+    else
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/**
+ * Check that the given object is a Wallpaper which was created for this
+ * OWallpaperD.
+ * @return The Wallpaper, or NULL with an exception set.
+ */
+static Wallpaper *check_wallpaper(OWallpaperD *self, PyObject *wallpaper_o)
+{
+    Wallpaper *wallpaper;
+    Py_ssize_t i;
+
+    if (!PyObject_TypeCheck(wallpaper_o, &WallpaperType)) {
+        PyErr_SetString(OWallpaperDError,
+                        "wallpaper must be a Wallpaper object");
+        return NULL;
+    } else
+        wallpaper = (Wallpaper*) wallpaper_o;
+
+    /*
+     * If the slots and their displays for the given Wallpaper don't match with
+     * our members, then we can't use this Wallpaper object
+     */
+    if (wallpaper->num_slots != self->num_slots)
+        goto mismatch;
+    for (i = 0; i < self->num_slots; ++i) {
+        if (wallpaper->displays[i] !=
+            SCREEN_CONNECTION(self, self->slot_screens[i])->display)
+            goto mismatch;
+    }
+
+    return wallpaper;
+
+mismatch:
+    PyErr_SetString(OWallpaperDError,
+                    "Wallpaper was not created for this OWallpaperD");
+    return NULL;
+}
+
+/**
+ * Set the background of a desktop window. Must be called with the GIL held,
+ * since it records the window's current pixmap.
+ */
+static void set_background(OWallpaperD *self, Py_ssize_t xinerama_screen,
+                           Pixmap pixmap)
+{
+    Display *display = SCREEN_CONNECTION(self, xinerama_screen)->display;
+    Window window = self->windows[xinerama_screen];
+
+    XKillClient(display, AllTemporary);
+    XSetCloseDownMode(display, RetainTemporary);
+
+    XSetWindowBackgroundPixmap(display, window, pixmap);
+    XClearWindow(display, window);
+
+    self->current_pixmaps[xinerama_screen] = pixmap;
+}
+
+/**
+ * Free the pixmap of a Wallpaper for a slot so that it will be rendered again
+ * if it's needed.
+ */
+static void release_wallpaper_pixmap(OWallpaperD *self, Wallpaper *wallpaper,
+                                     Py_ssize_t slot)
+{
+    Pixmap pixmap = wallpaper->pixmaps[slot];
+    Py_ssize_t i;
+
+    if (!pixmap)
+        return;
+
+    /*
+     * The server keeps the window background, but the XID may be reused, so
+     * forget that it's current
+     */
+    for (i = 0; i < self->num_screens; ++i) {
+        if (self->slots[i] == slot && self->current_pixmaps[i] == pixmap)
+            self->current_pixmaps[i] = None;
+    }
+    XFreePixmap(wallpaper->displays[slot], pixmap);
+    wallpaper->pixmaps[slot] = None;
+}
+
+/**
+ * Free the pixmaps of a Wallpaper so that it will be rendered again if it's
+ * needed.
+ */
+static void release_wallpaper_pixmaps(OWallpaperD *self, Wallpaper *wallpaper)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < wallpaper->num_slots; ++i)
+        release_wallpaper_pixmap(self, wallpaper, i);
+}
+
+/**
+ * Free the pixmap of a cached Wallpaper for a slot, since it can be restored
+ * from the image cache. It's kept if the image isn't actually in the cache,
+ * e.g., because the cache is disabled or the image didn't fit.
+ */
+static void release_cached_pixmap(OWallpaperD *self, Wallpaper *wallpaper,
+                                  Py_ssize_t slot)
+{
+    if (wallpaper->cached && wallpaper->pixmaps[slot] &&
+        wallpaper_in_cache(wallpaper, self, self->slot_screens[slot]))
+        release_wallpaper_pixmap(self, wallpaper, slot);
+}
+
+/**
+ * Set the background of a desktop window to the given Wallpaper's pixmap,
+ * rendering it first if necessary. Must be called with the GIL held. The
+ * caller is responsible for flushing the display.
+ * @return Zero on success, an error code for set_render_error() on failure.
+ */
+static int apply_wallpaper(OWallpaperD *self, Py_ssize_t xinerama_screen,
+                           Wallpaper *wallpaper)
+{
+    Progressive *progressive = &self->progressive[xinerama_screen];
+    Display *display = SCREEN_CONNECTION(self, xinerama_screen)->display;
+    Py_ssize_t slot = self->slots[xinerama_screen];
+    Pixmap pixmap;
+    int error;
+
+    error = wallpaper_render(wallpaper, self, xinerama_screen);
+    if (error)
+        return error;
+
+    pixmap = wallpaper->pixmaps[slot];
+    if (self->current_pixmaps[xinerama_screen] == pixmap)
+        return 0;
+
+    set_background(self, xinerama_screen, pixmap);
+
+    /*
+     * The server keeps the window background, so a cached wallpaper doesn't
+     * need its pixmap any more
+     */
+    release_cached_pixmap(self, wallpaper, slot);
+
+    /* This replaces any preview which was being shown */
+    if (progressive->preview) {
+        XFreePixmap(display, progressive->preview);
+        progressive->preview = None;
+    }
+    progressive->wallpaper = NULL;
+    return 0;
+}
+
+/**
+ * Create a render job for a Wallpaper on a Xinerama screen and mark its slot
+ * as pending. The job holds a reference to the Wallpaper.
+ * @return The job, or NULL if we ran out of memory.
+ */
+static RenderJob *new_render_job(OWallpaperD *self, Wallpaper *wallpaper,
+                                 Py_ssize_t xinerama_screen)
+{
+    Connection *connection = SCREEN_CONNECTION(self, xinerama_screen);
+    RenderJob *job;
+
+    job = render_job_new(connection->display, connection->screen,
+                         self->windows[xinerama_screen],
+                         &self->screens[xinerama_screen],
+                         wallpaper->image_path, wallpaper->mode,
+                         wallpaper->background_color, wallpaper->cached);
+    if (!job)
+        return NULL;
+
+    Py_INCREF(wallpaper);
+    job->data = wallpaper;
+    job->index = xinerama_screen;
+    wallpaper->pending[self->slots[xinerama_screen]] = 1;
+    return job;
+}
+
+/**
+ * Queue a render job and its group, falling back to rendering them
+ * synchronously if that isn't possible.
+ * @return Zero if the jobs were queued or rendered, an error code for
+ * set_render_error() if a synchronous render failed.
+ */
+static int submit_render_job(OWallpaperD *self, RenderJob *job)
+{
+    RenderJob *group;
+    int error, ret = 0;
+
+    if (!render_queue_submit(self->render_queue, job))
+        return 0;
+
+    for (; job; job = group) {
+        Wallpaper *wallpaper = job->data;
+
+        group = job->group;
+        wallpaper->pending[self->slots[job->index]] = 0;
+        error = wallpaper_render(wallpaper, self, job->index);
+        if (error && !ret)
+            ret = error;
+        Py_DECREF(wallpaper);
+        render_job_free(job);
+    }
+    return ret;
+}
+
+/**
+ * Whether two slots can share a render: their Xinerama screens are the same
+ * size, and their X screens' default visuals have the same format.
+ */
+static int slots_share_render(OWallpaperD *self, Py_ssize_t a, Py_ssize_t b)
+{
+    Py_ssize_t screen_a = self->slot_screens[a];
+    Py_ssize_t screen_b = self->slot_screens[b];
+    Connection *connection_a = SCREEN_CONNECTION(self, screen_a);
+    Connection *connection_b = SCREEN_CONNECTION(self, screen_b);
+    VisualFormat format_a, format_b;
+
+    if (self->screens[screen_a].width != self->screens[screen_b].width ||
+        self->screens[screen_a].height != self->screens[screen_b].height)
+        return 0;
+    if (connection_a == connection_b)
+        return 1;
+
+    get_visual_format(connection_a->display, connection_a->screen,
+                      &format_a);
+    get_visual_format(connection_b->display, connection_b->screen,
+                      &format_b);
+    return visual_format_equal(&format_a, &format_b);
+}
+
+/**
+ * Add a render of a Wallpaper for a slot to a group of render jobs, or render
+ * it synchronously if a job can't be made. Nothing is done if the slot already
+ * has the wallpaper or a queued render.
+ * @return Zero on success, an error code for set_render_error() if a
+ * synchronous render failed.
+ */
+static int add_group_render(OWallpaperD *self, Wallpaper *wallpaper,
+                            Py_ssize_t slot, RenderJob **job,
+                            RenderJob **tail)
+{
+    RenderJob *member;
+
+    if (wallpaper->pixmaps[slot] || wallpaper->pending[slot])
+        return 0;
+
+    member = new_render_job(self, wallpaper, self->slot_screens[slot]);
+    if (!member)
+        return wallpaper_render(wallpaper, self, self->slot_screens[slot]);
+    if (*tail)
+        (*tail)->group = member;
+    else
+        *job = member;
+    *tail = member;
+    return 0;
+}
+
+/**
+ * Queue background renders of a Wallpaper for a slot and the other wanted
+ * slots which can share its render. They're rendered as a group by one thread,
+ * starting with the given slot, so the image is only decoded and scaled once.
+ * @param wanted A flag for each slot, or NULL for every slot.
+ * @return Zero if the renders were queued or done, an error code for
+ * set_render_error() if a synchronous render failed.
+ */
+static int render_group(OWallpaperD *self, Wallpaper *wallpaper,
+                        Py_ssize_t slot, const char *wanted)
+{
+    RenderJob *job = NULL, *tail = NULL;
+    Py_ssize_t i;
+    int error, ret;
+
+    ret = add_group_render(self, wallpaper, slot, &job, &tail);
+    for (i = 0; i < self->num_slots; ++i) {
+        if (i == slot || (wanted && !wanted[i]) ||
+            !slots_share_render(self, slot, i))
+            continue;
+        error = add_group_render(self, wallpaper, i, &job, &tail);
+        if (error && !ret)
+            ret = error;
+    }
+
+    if (job) {
+        error = submit_render_job(self, job);
+        if (error && !ret)
+            ret = error;
+    }
+    return ret;
+}
+
+/**
+ * Queue background renders of a Wallpaper for the wanted slots, grouping the
+ * slots which can share a render as render_group() does.
+ * @param wanted A flag for each slot, or NULL for every slot.
+ * @return Zero if the renders were queued or done, an error code for
+ * set_render_error() if a synchronous render failed.
+ */
+static int render_slots(OWallpaperD *self, Wallpaper *wallpaper,
+                        const char *wanted)
+{
+    Py_ssize_t i;
+    int error, ret = 0;
+
+    for (i = 0; i < self->num_slots; ++i) {
+        /* Slots in an earlier slot's group are pending by now */
+        if ((wanted && !wanted[i]) || wallpaper->pixmaps[i] ||
+            wallpaper->pending[i])
+            continue;
+
+        error = render_group(self, wallpaper, i, wanted);
+        if (error && !ret)
+            ret = error;
+    }
+    return ret;
+}
+
+/**
+ * Show a preview of a Wallpaper on a Xinerama screen and render the full
+ * quality version in the background, to be swapped in by reap_renders().
+ * @return Zero on success, an error code for set_render_error() on failure.
+ */
+static int apply_wallpaper_progressive(OWallpaperD *self,
+                                       Py_ssize_t xinerama_screen,
+                                       Wallpaper *wallpaper, double start)
+{
+    Progressive *progressive = &self->progressive[xinerama_screen];
+    Connection *connection = SCREEN_CONNECTION(self, xinerama_screen);
+    Pixmap preview;
+    int error;
+
+    Py_BEGIN_ALLOW_THREADS
+    error = create_preview(connection->display, connection->screen,
+                           self->windows[xinerama_screen],
+                           &self->screens[xinerama_screen],
+                           wallpaper->image_path, wallpaper->mode,
+                           wallpaper->background_color, &preview);
+    Py_END_ALLOW_THREADS
+    if (error)
+        return error;
+
+    set_background(self, xinerama_screen, preview);
+    if (progressive->preview)
+        XFreePixmap(connection->display, progressive->preview);
+    progressive->wallpaper = (PyObject*) wallpaper;
+    progressive->preview = preview;
+    progressive->start = start;
+    XFlush(connection->display);
+
+    /* Screens which can share the render get it in the same group */
+    render_group(self, wallpaper, self->slots[xinerama_screen], NULL);
+
+    /* It may have been rendered synchronously if the submission failed */
+    if (wallpaper->pixmaps[self->slots[xinerama_screen]]) {
+        error = apply_wallpaper(self, xinerama_screen, wallpaper);
+        if (error)
+            return error;
+        self->stats.full_quality_switches++;
+        self->stats.full_quality_time += monotonic_time() - start;
+    }
+    return 0;
+}
+
+static PyObject *OWallpaperD_set_wallpaper(OWallpaperD *self, PyObject *args,
+                                           PyObject *kwds)
+{
+    PyObject *wallpaper_o;
+    Wallpaper *wallpaper;
+    int xinerama_screen;
+    int progressive = 0;
+    double start;
+    int error;
+
+    static char *kwlist[] = {"screen", "wallpaper", "progressive", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO|p", kwlist,
+                                     &xinerama_screen, &wallpaper_o,
+                                     &progressive))
+        return NULL;
+
+    if (self->handed_off) {
+        PyErr_SetString(OWallpaperDError, "already handed off");
+        return NULL;
+    }
+
+    wallpaper = check_wallpaper(self, wallpaper_o);
+    if (!wallpaper)
+        return NULL;
+
+    if (xinerama_screen < 0 || xinerama_screen >= self->num_screens) {
+        PyErr_SetString(PyExc_IndexError, "screen out of bounds");
+        return NULL;
+    }
+
+    /* A cache hit is quick enough to skip the preview */
+    start = monotonic_time();
+    if (progressive && !wallpaper->pixmaps[self->slots[xinerama_screen]] &&
+        !wallpaper_in_cache(wallpaper, self, xinerama_screen) &&
+        !apply_wallpaper_progressive(self, xinerama_screen, wallpaper,
+                                     start)) {
+        self->stats.switches++;
+        self->stats.first_pixels_time += monotonic_time() - start;
+        Py_RETURN_NONE;
+    }
+
+    /* Actually set the wallpaper, falling back from a failed preview */
+    error = apply_wallpaper(self, xinerama_screen, wallpaper);
+    if (error) {
+        set_render_error(error);
+        return NULL;
+    }
+
+    XFlush(SCREEN_CONNECTION(self, xinerama_screen)->display);
+    XSync(SCREEN_CONNECTION(self, xinerama_screen)->display, False);
+
+    self->stats.switches++;
+    self->stats.first_pixels_time += monotonic_time() - start;
+    self->stats.full_quality_switches++;
+    self->stats.full_quality_time += monotonic_time() - start;
+
+    Py_RETURN_NONE;
+}
+
+/**
+ * Convert a workspace table policy (a sequence indexed by workspace or a dict
+ * keyed by workspace) into a tuple of Wallpapers or None, indexed by
+ * workspace.
+ */
+static PyObject *make_policy_table(OWallpaperD *self, PyObject *policy)
+{
+    PyObject *table;
+    Py_ssize_t i, size;
+
+    if (PyDict_Check(policy)) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+
+        size = 0;
+        while (PyDict_Next(policy, &pos, &key, &value)) {
+            Py_ssize_t workspace = PyLong_AsSsize_t(key);
+            if (workspace == -1 && PyErr_Occurred())
+                return NULL;
+            if (workspace < 0) {
+                PyErr_SetString(OWallpaperDError,
+                                "workspace numbers must be non-negative");
+                return NULL;
+            }
+            if (workspace >= size)
+                size = workspace + 1;
+        }
+
+        table = PyTuple_New(size);
+        if (!table)
+            return NULL;
+        for (i = 0; i < size; ++i) {
+            Py_INCREF(Py_None);
+            PyTuple_SET_ITEM(table, i, Py_None);
+        }
+
+        pos = 0;
+        while (PyDict_Next(policy, &pos, &key, &value)) {
+            Py_ssize_t workspace = PyLong_AsSsize_t(key);
+            Py_INCREF(value);
+            Py_DECREF(PyTuple_GET_ITEM(table, workspace));
+            PyTuple_SET_ITEM(table, workspace, value);
+        }
+    } else {
+        table = PySequence_Tuple(policy);
+        if (!table)
+            return NULL;
+    }
+
+    size = PyTuple_GET_SIZE(table);
+    for (i = 0; i < size; ++i) {
+        PyObject *item = PyTuple_GET_ITEM(table, i);
+        if (item != Py_None && !check_wallpaper(self, item)) {
+            Py_DECREF(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+static PyObject *OWallpaperD_set_policy(OWallpaperD *self, PyObject *args)
+{
+    PyObject *policy;
+    PyObject *table = NULL, *callable = NULL;
+    PolicyKind kind;
+
+    if (!PyArg_ParseTuple(args, "O", &policy))
+        return NULL;
+
+    if (self->running) {
+        PyErr_SetString(OWallpaperDError,
+                        "cannot change the policy while running");
+        return NULL;
+    }
+
+    if (policy == Py_None)
+        kind = POLICY_NONE;
+    else if (PyUnicode_Check(policy)) {
+        if (PyUnicode_CompareWithASCIIString(policy, "modulo") != 0) {
+            PyErr_SetString(OWallpaperDError,
+                            "unknown policy (should be 'modulo')");
+            return NULL;
+        }
+        kind = POLICY_MODULO;
+    } else if (PyCallable_Check(policy)) {
+        kind = POLICY_CALLABLE;
+        Py_INCREF(policy);
+        callable = policy;
+    } else {
+        kind = POLICY_TABLE;
+        table = make_policy_table(self, policy);
+        if (!table)
+            return NULL;
+    }
+
+    self->policy = kind;
+    Py_XDECREF(self->policy_table);
+    self->policy_table = table;
+    Py_XDECREF(self->policy_callable);
+    self->policy_callable = callable;
+
+    Py_RETURN_NONE;
+}
+
+/**
+ * Take a new snapshot of the wallpapers list for the modulo policy.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int refresh_policy_table(OWallpaperD *self)
+{
+    PyObject *table;
+
+    if (self->policy != POLICY_MODULO)
+        return 0;
+
+    table = make_policy_table(self, self->wallpapers);
+    if (!table)
+        return -1;
+    Py_XDECREF(self->policy_table);
+    self->policy_table = table;
+    return 0;
+}
+
+/**
+ * Pick the wallpaper for a workspace using a modulo or table policy. This
+ * doesn't touch any Python state, so it may be called without the GIL.
+ * @return The wallpaper, or NULL if the policy doesn't specify one.
+ */
+static Wallpaper *policy_lookup(OWallpaperD *self, long workspace)
+{
+    Py_ssize_t size, index;
+    PyObject *item;
+
+    size = PyTuple_GET_SIZE(self->policy_table);
+    if (size == 0)
+        return NULL;
+
+    if (self->policy == POLICY_MODULO)
+        index = ((workspace % size) + size) % size;
+    else if (workspace >= 0 && workspace < size)
+        index = workspace;
+    else
+        return NULL;
+
+    item = PyTuple_GET_ITEM(self->policy_table, index);
+    return item == Py_None ? NULL : (Wallpaper*) item;
+}
+
+/**
+ * Apply the policy to every Xinerama screen whose workspace changed. Must be
+ * called with the GIL held. Wallpapers which fail to render are skipped (and
+ * counted in the stats) rather than stopping the event loop.
+ * @return Zero on success, -1 with an exception set if the callable failed.
+ */
+static int apply_policy(OWallpaperD *self, const char *changed)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->num_screens; ++i) {
+        /* Screens running a slideshow ignore workspace changes */
+        if (!changed[i] || self->slideshows[i].wallpapers)
+            continue;
+
+        if (self->policy == POLICY_CALLABLE) {
+            PyObject *result;
+            Wallpaper *wallpaper;
+
+            result = PyObject_CallFunction(self->policy_callable, "nl", i,
+                                           self->workspaces[i]);
+            if (!result)
+                return -1;
+            if (result != Py_None) {
+                wallpaper = check_wallpaper(self, result);
+                if (!wallpaper) {
+                    Py_DECREF(result);
+                    return -1;
+                }
+                apply_wallpaper(self, i, wallpaper);
+            }
+            Py_DECREF(result);
+        } else {
+            Wallpaper *wallpaper = policy_lookup(self, self->workspaces[i]);
+
+            /*
+             * Rendering releases the GIL, and the policy table can be replaced
+             * in the meantime
+             */
+            if (wallpaper) {
+                Py_INCREF(wallpaper);
+                apply_wallpaper(self, i, wallpaper);
+                Py_DECREF(wallpaper);
+            }
+        }
+    }
+    flush_connections(self);
+    return 0;
+}
+
+static PyObject *OWallpaperD_set_slideshow(OWallpaperD *self, PyObject *args,
+                                           PyObject *kwds)
+{
+    Slideshow *slideshow;
+    PyObject *wallpapers_o = NULL, *wallpapers;
+    int xinerama_screen;
+    double interval;
+
+    static char *kwlist[] = {"screen", "interval", "wallpapers", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "id|O", kwlist,
+                                     &xinerama_screen, &interval,
+                                     &wallpapers_o))
+        return NULL;
+
+    if (self->running) {
+        PyErr_SetString(OWallpaperDError,
+                        "cannot change a slideshow while running");
+        return NULL;
+    }
+
+    if (xinerama_screen < 0 || xinerama_screen >= self->num_screens) {
+        PyErr_SetString(PyExc_IndexError, "screen out of bounds");
+        return NULL;
+    }
+    slideshow = &self->slideshows[xinerama_screen];
+
+    /* A non-positive interval stops the slideshow */
+    if (interval <= 0.0) {
+        Py_CLEAR(slideshow->wallpapers);
+        Py_RETURN_NONE;
+    }
+
+    if (!wallpapers_o || wallpapers_o == Py_None)
+        wallpapers_o = self->wallpapers;
+    if (PyDict_Check(wallpapers_o)) {
+        PyErr_SetString(PyExc_TypeError, "wallpapers must be a sequence");
+        return NULL;
+    }
+    wallpapers = make_policy_table(self, wallpapers_o);
+    if (!wallpapers)
+        return NULL;
+    if (PyTuple_GET_SIZE(wallpapers) == 0 ||
+        PySequence_Contains(wallpapers, Py_None)) {
+        PyErr_SetString(OWallpaperDError,
+                        "slideshow needs a non-empty sequence of Wallpapers");
+        Py_DECREF(wallpapers);
+        return NULL;
+    }
+
+    Py_XDECREF(slideshow->wallpapers);
+    slideshow->wallpapers = wallpapers;
+    slideshow->interval = interval;
+    slideshow->next = 0;
+    slideshow->late = 0;
+    slideshow->failures = 0;
+
+    Py_RETURN_NONE;
+}
+
+static Wallpaper *slideshow_next(Slideshow *slideshow)
+{
+    return (Wallpaper*) PyTuple_GET_ITEM(slideshow->wallpapers,
+                                         slideshow->next);
+}
+
+/**
+ * How long before a deadline to start rendering the next wallpaper: twice the
+ * time that renders on this screen have been taking, within limits.
+ */
+static double slideshow_lead(Slideshow *slideshow)
+{
+    double lead = 2.0 * slideshow->render_estimate;
+
+    if (lead < SLIDESHOW_MIN_LEAD)
+        lead = SLIDESHOW_MIN_LEAD;
+    if (lead > slideshow->interval)
+        lead = slideshow->interval;
+    return lead;
+}
+
+/**
+ * Skip the next wallpaper of a slideshow because it failed to render. A
+ * slideshow which was waiting for it moves on to the one after it right away,
+ * unless none of its wallpapers can be rendered, in which case it backs off
+ * for an interval instead of retrying them in a loop.
+ */
+static void slideshow_skip(Slideshow *slideshow, double now)
+{
+    Py_ssize_t size = PyTuple_GET_SIZE(slideshow->wallpapers);
+
+    slideshow->next = (slideshow->next + 1) % size;
+    if (++slideshow->failures >= size) {
+        slideshow->failures = 0;
+        slideshow->late = 0;
+        slideshow->deadline = now + slideshow->interval;
+    } else if (slideshow->late) {
+        slideshow->late = 0;
+        slideshow->deadline = now;
+    }
+}
+
+/**
+ * Show the next wallpaper of a slideshow and schedule the one after it, or
+ * skip it if it can't be shown. Must be called with the GIL held.
+ */
+static void slideshow_switch(OWallpaperD *self, Py_ssize_t xinerama_screen,
+                             double now)
+{
+    Slideshow *slideshow = &self->slideshows[xinerama_screen];
+
+    if (apply_wallpaper(self, xinerama_screen, slideshow_next(slideshow))) {
+        slideshow->late = 1;
+        slideshow_skip(slideshow, now);
+        return;
+    }
+    self->stats.slideshow_switches++;
+    slideshow->failures = 0;
+
+    slideshow->next = (slideshow->next + 1) %
+                      PyTuple_GET_SIZE(slideshow->wallpapers);
+    if (slideshow->late)
+        slideshow->deadline = now + slideshow->interval;
+    else
+        slideshow->deadline += slideshow->interval;
+    if (slideshow->deadline < now)
+        slideshow->deadline = now + slideshow->interval;
+    slideshow->late = 0;
+}
+
+/** Show the first wallpaper of each slideshow. */
+static void slideshow_start(OWallpaperD *self)
+{
+    double now = monotonic_time();
+    Py_ssize_t i;
+
+    for (i = 0; i < self->num_screens; ++i) {
+        Slideshow *slideshow = &self->slideshows[i];
+        if (slideshow->wallpapers) {
+            slideshow->late = 1;
+            slideshow_switch(self, i, now);
+        }
+    }
+}
+
+/**
+ * Whether the next wallpaper of a slideshow should be rendered in the
+ * background now.
+ * @param slot Slot of the slideshow's Xinerama screen.
+ */
+static int slideshow_needs_render(Slideshow *slideshow, Py_ssize_t slot,
+                                  double now)
+{
+    Wallpaper *wallpaper = slideshow_next(slideshow);
+
+    if (wallpaper->pixmaps[slot] || wallpaper->pending[slot])
+        return 0;
+    return slideshow->late ||
+           now >= slideshow->deadline - slideshow_lead(slideshow);
+}
+
+/**
+ * Switch every slideshow whose deadline has passed. If the next wallpaper
+ * isn't rendered yet, the deadline is missed and the switch happens as soon as
+ * the render finishes. Must be called with the GIL held.
+ * @return Non-zero if slideshow_prerender() should be called.
+ */
+static int slideshow_tick(OWallpaperD *self, double now)
+{
+    Py_ssize_t i;
+    int need_render = 0;
+
+    for (i = 0; i < self->num_screens; ++i) {
+        Slideshow *slideshow = &self->slideshows[i];
+
+        if (!slideshow->wallpapers)
+            continue;
+
+        if (!slideshow->late && now >= slideshow->deadline) {
+            if (slideshow_next(slideshow)->pixmaps[self->slots[i]])
+                slideshow_switch(self, i, now);
+            else {
+                slideshow->late = 1;
+                self->stats.missed_deadlines++;
+            }
+        }
+
+        if (slideshow_needs_render(slideshow, self->slots[i], now))
+            need_render = 1;
+    }
+    return need_render;
+}
+
+/**
+ * Start rendering the next wallpaper of every slideshow which is getting close
+ * to its deadline. Must be called with the GIL held.
+ */
+static void slideshow_prerender(OWallpaperD *self, double now)
+{
+    Py_ssize_t i, j;
+    char *wanted;
+
+    wanted = PyMem_New(char, self->num_slots);
+    for (i = 0; i < self->num_screens; ++i) {
+        Slideshow *slideshow = &self->slideshows[i];
+        Wallpaper *wallpaper;
+        int error;
+
+        if (!slideshow->wallpapers ||
+            !slideshow_needs_render(slideshow, self->slots[i], now))
+            continue;
+        wallpaper = slideshow_next(slideshow);
+
+        if (!wanted) {
+            if (render_group(self, wallpaper, self->slots[i], NULL))
+                slideshow_skip(slideshow, now);
+            continue;
+        }
+
+        /*
+         * Render it for every screen whose slideshow needs it now in one go,
+         * so that screens which can share the render do
+         */
+        memset(wanted, 0, self->num_slots);
+        for (j = i; j < self->num_screens; ++j) {
+            Slideshow *other = &self->slideshows[j];
+
+            if (other->wallpapers && slideshow_next(other) == wallpaper &&
+                slideshow_needs_render(other, self->slots[j], now))
+                wanted[self->slots[j]] = 1;
+        }
+        error = render_slots(self, wallpaper, wanted);
+        if (!error)
+            continue;
+
+        for (j = i; j < self->num_screens; ++j) {
+            Slideshow *other = &self->slideshows[j];
+
+            if (other->wallpapers && wanted[self->slots[j]] &&
+                slideshow_next(other) == wallpaper)
+                slideshow_skip(other, now);
+        }
+    }
+    PyMem_Free(wanted);
+}
+
+/**
+ * Arm the timer for the next slideshow event: either a deadline or the time to
+ * start rendering for one. Must be called with the GIL held.
+ */
+static void slideshow_arm_timer(OWallpaperD *self)
+{
+    struct itimerspec timer;
+    double next = DBL_MAX;
+    Py_ssize_t i;
+
+    for (i = 0; i < self->num_screens; ++i) {
+        Slideshow *slideshow = &self->slideshows[i];
+        Wallpaper *wallpaper;
+        double when;
+
+        /* Late slideshows are waiting for a render to finish */
+        if (!slideshow->wallpapers || slideshow->late)
+            continue;
+
+        when = slideshow->deadline;
+        wallpaper = slideshow_next(slideshow);
+        if (!wallpaper->pixmaps[self->slots[i]] &&
+            !wallpaper->pending[self->slots[i]])
+            when -= slideshow_lead(slideshow);
+        if (when < next)
+            next = when;
+    }
+
+    memset(&timer, 0, sizeof(timer));
+    if (next != DBL_MAX) {
+        /* A zero it_value would disarm the timer */
+        if (next <= 0.0)
+            next = 1e-9;
+        timer.it_value.tv_sec = (time_t) next;
+        timer.it_value.tv_nsec = (long) ((next - (time_t) next) * 1e9);
+    }
+    timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/** Index in the wallpapers list of the Wallpaper for an image, or -1. */
+static Py_ssize_t find_wallpaper(OWallpaperD *self, const char *image_path)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < PyList_GET_SIZE(self->wallpapers); ++i) {
+        PyObject *item = PyList_GET_ITEM(self->wallpapers, i);
+        if (PyObject_TypeCheck(item, &WallpaperType) &&
+            strcmp(((Wallpaper*) item)->image_path, image_path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Add a Wallpaper from a watched directory to the wallpapers list, replacing
+ * the Wallpaper for the previous version of the file in place. Must be called
+ * with the GIL held.
+ * @return Zero on success, -1 with an exception set on failure.
+ */
+static int publish_wallpaper(OWallpaperD *self, Wallpaper *wallpaper)
+{
+    Py_ssize_t i;
+
+    i = find_wallpaper(self, wallpaper->image_path);
+    if (i == -1) {
+        if (PyList_Append(self->wallpapers, (PyObject*) wallpaper) == -1)
+            return -1;
+    } else {
+        release_wallpaper_pixmaps(self,
+            (Wallpaper*) PyList_GET_ITEM(self->wallpapers, i));
+        Py_INCREF(wallpaper);
+        PyList_SetItem(self->wallpapers, i, (PyObject*) wallpaper);
+    }
+
+    /* Rendering a cached wallpaper was just to fill the image cache */
+    for (i = 0; i < wallpaper->num_slots; ++i)
+        release_cached_pixmap(self, wallpaper, i);
+    return refresh_policy_table(self);
+}
+
+/**
+ * Publish a Wallpaper for a changed file in a watched directory once all of its
+ * background renders are done, or drop it if any of them failed (e.g., because
+ * the file isn't an image). Must be called with the GIL held.
+ */
+static void finish_loading(OWallpaperD *self, Wallpaper *wallpaper)
+{
+    PyObject *key;
+    Py_ssize_t i;
+    int rendered = 1;
+
+    for (i = 0; i < wallpaper->num_slots; ++i) {
+        if (wallpaper->pending[i])
+            return;
+        if (!wallpaper->pixmaps[i])
+            rendered = 0;
+    }
+
+    key = PyUnicode_DecodeFSDefault(wallpaper->image_path);
+    if (!key)
+        goto err;
+    if (PyDict_GetItem(self->loading, key) != (PyObject*) wallpaper) {
+        Py_DECREF(key);
+        return;
+    }
+
+    if ((rendered && publish_wallpaper(self, wallpaper)) ||
+        PyDict_DelItem(self->loading, key)) {
+        Py_DECREF(key);
+        goto err;
+    }
+    Py_DECREF(key);
+    return;
+
+err:
+    /* There's nobody to report this to */
+    PyErr_WriteUnraisable((PyObject*) self);
+}
+
+/**
+ * Collect the wallpapers rendered in the background, and switch any slideshow
+ * which was waiting for one. Must be called with the GIL held.
+ */
+static void reap_renders(OWallpaperD *self)
+{
+    RenderJob *job, *next;
+    double now = monotonic_time();
+
+    for (job = render_queue_take_finished(self->render_queue); job;
+         job = next) {
+        Wallpaper *wallpaper = job->data;
+        Py_ssize_t i, slot = self->slots[job->index];
+
+        next = job->next;
+        wallpaper->pending[slot] = 0;
+
+        if (job->error)
+            self->stats.render_errors++;
+        else {
+            self->stats.renders++;
+            self->stats.background_renders++;
+            self->stats.render_time += job->render_time;
+
+            /* We may have rendered it synchronously in the meantime */
+            if (wallpaper->pixmaps[slot])
+                XFreePixmap(job->display, job->pixmap);
+            else
+                wallpaper->pixmaps[slot] = job->pixmap;
+        }
+
+        /* Every Xinerama screen using the slot may be waiting for it */
+        for (i = 0; i < self->num_screens; ++i) {
+            Slideshow *slideshow = &self->slideshows[i];
+            int waiting;
+
+            if (self->slots[i] != slot)
+                continue;
+            waiting = slideshow->wallpapers && slideshow->late &&
+                      slideshow_next(slideshow) == wallpaper;
+
+            if (job->error) {
+                /*
+                 * Skip a wallpaper which can't be rendered, whether or not the
+                 * deadline has passed, so that it isn't resubmitted
+                 */
+                if (slideshow->wallpapers &&
+                    slideshow_next(slideshow) == wallpaper)
+                    slideshow_skip(slideshow, now);
+
+                /* Keep showing the preview if the full render failed */
+                if (self->progressive[i].wallpaper == (PyObject*) wallpaper)
+                    self->progressive[i].wallpaper = NULL;
+                continue;
+            }
+
+            if (slideshow->render_estimate)
+                slideshow->render_estimate =
+                    0.75 * slideshow->render_estimate +
+                    0.25 * job->render_time;
+            else
+                slideshow->render_estimate = job->render_time;
+
+            if (waiting)
+                slideshow_switch(self, i, now);
+
+            /* Swap out the preview for a progressive switch */
+            if (self->progressive[i].wallpaper == (PyObject*) wallpaper) {
+                double start = self->progressive[i].start;
+                apply_wallpaper(self, i, wallpaper);
+                self->stats.full_quality_switches++;
+                self->stats.full_quality_time += now - start;
+            }
+        }
+
+        finish_loading(self, wallpaper);
+        Py_DECREF(wallpaper);
+        render_job_free(job);
+    }
+    flush_connections(self);
+}
+
+/**
+ * Block until one of the X connections, the slideshow timer, the render queue,
+ * or a watched directory has something for us.
+ * @return Mask of EVENT_X, EVENT_TIMER, EVENT_RENDER, and EVENT_WATCH, or -1
+ * if interrupted by a signal.
+ */
+static int poll_events(OWallpaperD *self)
+{
+    struct pollfd *pollfds = self->pollfds;
+    Py_ssize_t i, n = self->num_connections;
+    int ready = 0;
+
+    for (i = 0; i < n; ++i) {
+        pollfds[i].fd = ConnectionNumber(self->connections[i].display);
+        pollfds[i].events = POLLIN;
+
+        /* Don't block if Xlib has already read events off of the connection */
+        if (XPending(self->connections[i].display))
+            ready |= EVENT_X;
+    }
+    pollfds[n].fd = self->timer_fd;
+    pollfds[n].events = POLLIN;
+    pollfds[n + 1].fd = self->render_queue->event_fd;
+    pollfds[n + 1].events = POLLIN;
+    pollfds[n + 2].fd = self->inotify_fd > 0 ? self->inotify_fd : -1;
+    pollfds[n + 2].events = POLLIN;
+
+    if (poll(pollfds, n + 3, ready ? 0 : -1) == -1) {
+        if (errno == EINTR)
+            return -1;
+        return ready;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (pollfds[i].revents)
+            ready |= EVENT_X;
+    }
+    if (pollfds[n].revents)
+        ready |= EVENT_TIMER;
+    if (pollfds[n + 1].revents)
+        ready |= EVENT_RENDER;
+    if (pollfds[n + 2].revents)
+        ready |= EVENT_WATCH;
+    return ready;
+}
+
+/**
+ * Create a lazy Wallpaper for a file in a watched directory.
+ * @return New reference to the Wallpaper, or NULL with an exception set.
+ */
+static PyObject *new_directory_wallpaper(OWallpaperD *self,
+                                         WatchedDirectory *directory,
+                                         const char *image_path)
+{
+    PyObject *path, *args, *wallpaper;
+
+    path = PyUnicode_DecodeFSDefault(image_path);
+    if (!path)
+        return NULL;
+    args = PyTuple_Pack(2, (PyObject*) self, path);
+    Py_DECREF(path);
+    if (!args)
+        return NULL;
+
+    wallpaper = PyObject_Call((PyObject*) &WallpaperType, args,
+                              directory->kwds);
+    Py_DECREF(args);
+    return wallpaper;
+}
+
+/**
+ * Check whether a file in a watched directory is an image. Lazy wallpapers
+ * aren't rendered until they're needed, so this is done up front for them.
+ * Must be called with the GIL held.
+ */
+static int directory_file_loadable(const char *image_path)
+{
+    int loadable;
+
+    Py_BEGIN_ALLOW_THREADS
+    loadable = image_file_loadable(image_path);
+    Py_END_ALLOW_THREADS
+    return loadable;
+}
+
+/** Load a new or modified file in a watched directory in the background. */
+static void load_directory_file(OWallpaperD *self,
+                                WatchedDirectory *directory,
+                                const char *image_path)
+{
+    PyObject *wallpaper, *key;
+
+    /* Skip files which aren't images */
+    if (directory->lazy && !directory_file_loadable(image_path))
+        return;
+
+    wallpaper = new_directory_wallpaper(self, directory, image_path);
+    if (!wallpaper)
+        goto err;
+
+    if (directory->lazy) {
+        if (publish_wallpaper(self, (Wallpaper*) wallpaper))
+            goto err;
+        Py_DECREF(wallpaper);
+        return;
+    }
+
+    key = PyUnicode_DecodeFSDefault(image_path);
+    if (!key || PyDict_SetItem(self->loading, key, wallpaper)) {
+        Py_XDECREF(key);
+        goto err;
+    }
+    Py_DECREF(key);
+
+    render_slots(self, (Wallpaper*) wallpaper, NULL);
+
+    /* In case everything was rendered synchronously */
+    finish_loading(self, (Wallpaper*) wallpaper);
+    Py_DECREF(wallpaper);
+    return;
+
+err:
+    Py_XDECREF(wallpaper);
+    PyErr_WriteUnraisable((PyObject*) self);
+}
+
+/** Drop the Wallpaper for a file which was removed from a watched directory. */
+static void remove_directory_file(OWallpaperD *self, const char *image_path)
+{
+    PyObject *key;
+    Py_ssize_t i;
+
+    key = PyUnicode_DecodeFSDefault(image_path);
+    if (!key)
+        goto err;
+    if (PyDict_GetItem(self->loading, key) &&
+        PyDict_DelItem(self->loading, key)) {
+        Py_DECREF(key);
+        goto err;
+    }
+    Py_DECREF(key);
+
+    i = find_wallpaper(self, image_path);
+    if (i == -1)
+        return;
+    release_wallpaper_pixmaps(self,
+        (Wallpaper*) PyList_GET_ITEM(self->wallpapers, i));
+    if (PySequence_DelItem(self->wallpapers, i) || refresh_policy_table(self))
+        goto err;
+    return;
+
+err:
+    PyErr_WriteUnraisable((PyObject*) self);
+}
+
+/**
+ * Whether we already have (or are loading) a Wallpaper for the current version
+ * of a file in a watched directory.
+ */
+static int directory_file_current(OWallpaperD *self, const char *image_path,
+                                  const struct stat *st)
+{
+    Wallpaper *wallpaper = NULL;
+    PyObject *key;
+    Py_ssize_t i;
+
+    key = PyUnicode_DecodeFSDefault(image_path);
+    if (!key) {
+        PyErr_Clear();
+        return 0;
+    }
+    wallpaper = (Wallpaper*) PyDict_GetItem(self->loading, key);
+    Py_DECREF(key);
+
+    if (!wallpaper) {
+        i = find_wallpaper(self, image_path);
+        if (i == -1)
+            return 0;
+        wallpaper = (Wallpaper*) PyList_GET_ITEM(self->wallpapers, i);
+    }
+    return wallpaper->mtime.tv_sec == st->st_mtim.tv_sec &&
+           wallpaper->mtime.tv_nsec == st->st_mtim.tv_nsec;
 }
 
-static int OWallpaperD_init(OWallpaperD *self, PyObject *args, PyObject *kwds)
+static int skip_hidden(const struct dirent *dirent)
 {
-    const char *display_name = NULL;
-    int screen_num = -1, num_screens;
+    return dirent->d_name[0] != '.';
+}
+
+/**
+ * Bring the Wallpapers from a watched directory up to date after the inotify
+ * queue overflowed and events were lost: load new and modified files and drop
+ * the Wallpapers for removed ones. Must be called with the GIL held.
+ */
+static void rescan_directory(OWallpaperD *self, WatchedDirectory *directory)
+{
+    struct dirent **names;
+    int num_names, k;
+    size_t len = strlen(directory->path);
+    char *image_path;
+    struct stat st;
     Py_ssize_t i;
 
-    static char *kwlist[] = {"display_name", "screen", NULL};
+    num_names = scandir(directory->path, &names, skip_hidden, alphasort);
+    if (num_names == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, directory->path);
+        PyErr_WriteUnraisable((PyObject*) self);
+        return;
+    }
+    for (k = 0; k < num_names; ++k) {
+        image_path = malloc(len + strlen(names[k]->d_name) + 2);
+        if (image_path) {
+            sprintf(image_path, "%s/%s", directory->path, names[k]->d_name);
+            if (stat(image_path, &st) == 0 && S_ISREG(st.st_mode) &&
+                !directory_file_current(self, image_path, &st))
+                load_directory_file(self, directory, image_path);
+            free(image_path);
+        }
+        free(names[k]);
+    }
+    free(names);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|si", kwlist,
-                                     &display_name, &screen_num))
-        return -1;
+    /* Going backwards, removals don't shift the entries still to be checked */
+    for (i = PyList_GET_SIZE(self->wallpapers) - 1; i >= 0; --i) {
+        PyObject *item = PyList_GET_ITEM(self->wallpapers, i);
+        const char *path;
 
-    /* Initialize X */
-    self->display = XOpenDisplay(display_name);
-    if (!self->display) {
-        if (display_name)
-            PyErr_Format(OWallpaperDError, "could not open display %s",
-                         display_name);
-        else
-            PyErr_SetString(OWallpaperDError, "could not open default display");
-        return -1;
+        if (!PyObject_TypeCheck(item, &WallpaperType))
+            continue;
+        path = ((Wallpaper*) item)->image_path;
+        if (strncmp(path, directory->path, len) == 0 && path[len] == '/' &&
+            !strchr(path + len + 1, '/') && stat(path, &st) == -1)
+            remove_directory_file(self, path);
     }
+}
 
-    if (screen_num == -1)
-        self->screen = DefaultScreen(self->display);
-    else
-        self->screen = screen_num;
+/**
+ * Handle the pending inotify events for the watched directories. Must be
+ * called with the GIL held.
+ */
+static void process_directory_changes(OWallpaperD *self)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    WatchedDirectory *directory;
+    char *image_path;
+    ssize_t len;
+    char *p;
+    Py_ssize_t i;
+    int overflowed = 0;
 
-    XSelectInput(self->display, RootWindow(self->display, self->screen),
-                 PropertyChangeMask);
+    while ((len = read(self->inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len;
+             p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event*) p;
 
-    /* Get info for Xinerama screens */
-    self->screens = XineramaQueryScreens(self->display, &num_screens);
-    if (!self->screens) {
-        PyErr_Format(OWallpaperDError, "Xinerama is not active");
-        return -1;
+            /* Events were dropped, so we'll have to look for ourselves */
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = 1;
+                continue;
+            }
+
+            directory = NULL;
+            for (i = 0; i < self->num_directories; ++i) {
+                if (self->directories[i]->wd == event->wd) {
+                    directory = self->directories[i];
+                    break;
+                }
+            }
+            if (!directory)
+                continue;
+
+            if (event->mask & IN_IGNORED) {
+                directory->wd = -1;
+                continue;
+            }
+
+            /* Skip hidden files, which include most editors' temporary files */
+            if (!event->len || event->name[0] == '.')
+                continue;
+
+            image_path = malloc(strlen(directory->path) + event->len + 2);
+            if (!image_path)
+                continue;
+            sprintf(image_path, "%s/%s", directory->path, event->name);
+
+            if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                load_directory_file(self, directory, image_path);
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                remove_directory_file(self, image_path);
+            free(image_path);
+        }
     }
-    self->num_screens = num_screens;
 
-    /* Create all of the desktop windows and map them */
-    self->windows = PyMem_New(Window, self->num_screens);
-    if (!self->windows) {
+    if (overflowed) {
+        for (i = 0; i < self->num_directories; ++i) {
+            if (self->directories[i]->wd != -1)
+                rescan_directory(self, self->directories[i]);
+        }
+    }
+    flush_connections(self);
+}
+
+static PyObject *OWallpaperD_add_wallpaper_directory(OWallpaperD *self,
+                                                     PyObject *args,
+                                                     PyObject *kwds)
+{
+    WatchedDirectory *directory, **directories;
+    const char *path;
+    const char *mode_string = NULL;
+    uint32_t background_color = 0x0;
+    int lazy = 0;
+    int cached = 0;
+
+    struct dirent **names = NULL;
+    int num_names = 0;
+    char *image_path;
+    struct stat st;
+    PyObject *wallpapers = NULL, *added = NULL;
+    Py_ssize_t i, j;
+    int wd;
+
+    static char *kwlist[] = {"path", "mode", "background_color", "lazy",
+                             "cached", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|sIpp", kwlist, &path,
+                                     &mode_string, &background_color, &lazy,
+                                     &cached))
+        return NULL;
+
+    if (wallpaper_mode_from_string(mode_string) == WALLPAPER_MODE_NONE) {
+        PyErr_SetString(OWallpaperDError,
+                        "unknown wallpaper mode "
+                        "(should be 'center', 'fill', 'full', or 'tile')");
+        return NULL;
+    }
+
+    /*
+     * Start watching before listing the directory so that we don't miss any
+     * changes in between
+     */
+    if (self->inotify_fd <= 0) {
+        self->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (self->inotify_fd == -1)
+            return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    wd = inotify_add_watch(self->inotify_fd, path,
+                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+                           IN_MOVED_FROM | IN_ONLYDIR);
+    if (wd == -1)
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+
+    directory = PyMem_New(WatchedDirectory, 1);
+    if (!directory) {
+        inotify_rm_watch(self->inotify_fd, wd);
+        return PyErr_NoMemory();
+    }
+    directory->wd = wd;
+    directory->lazy = lazy;
+    directory->path = strdup(path);
+    directory->kwds = Py_BuildValue("{s:s,s:k,s:O,s:O}", "mode",
+                                    mode_string ? mode_string : "full",
+                                    "background_color",
+                                    (unsigned long) background_color,
+                                    "lazy", Py_True,
+                                    "cached", cached ? Py_True : Py_False);
+    if (!directory->path || !directory->kwds) {
         PyErr_NoMemory();
-        return -1;
+        goto err;
     }
-    for (i = 0; i < self->num_screens; ++i) {
-        XineramaScreenInfo *info = &self->screens[i];
-        self->windows[i] = create_desktop_window(self->display, self->screen,
-                                                 info);
+
+    /* Load the current contents of the directory in parallel */
+    num_names = scandir(path, &names, skip_hidden, alphasort);
+    if (num_names == -1) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        goto err;
     }
-    for (i = 0; i < self->num_screens; ++i)
-        XMapWindow(self->display, self->windows[i]);
 
-    /* Allocate and initialize array for workspaces */
-    self->workspaces = PyMem_New(long, self->num_screens);
-    if (!self->workspaces) {
+    directories = PyMem_Realloc(self->directories,
+                                sizeof(WatchedDirectory*) *
+                                (self->num_directories + 1));
+    if (!directories) {
         PyErr_NoMemory();
-        return -1;
+        for (i = 0; i < num_names; ++i)
+            free(names[i]);
+        free(names);
+        goto err;
     }
+    self->directories = directories;
+    self->directories[self->num_directories++] = directory;
 
-    for (i = 0; i < self->num_screens; ++i)
-        self->workspaces[i] = -1;
+    wallpapers = PyList_New(0);
+    if (!wallpapers)
+        goto out;
+    for (i = 0; i < num_names; ++i) {
+        PyObject *wallpaper;
 
-    /* Create empty list of wallpapers */
-    self->wallpapers = PyList_New(0);
-    if (!self->wallpapers)
-        return -1;
+        image_path = malloc(strlen(path) + strlen(names[i]->d_name) + 2);
+        if (!image_path) {
+            PyErr_NoMemory();
+            goto out;
+        }
+        sprintf(image_path, "%s/%s", path, names[i]->d_name);
+        if (stat(image_path, &st) == -1 || !S_ISREG(st.st_mode) ||
+            (lazy && !directory_file_loadable(image_path))) {
+            free(image_path);
+            continue;
+        }
 
-    return 0;
-}
+        wallpaper = new_directory_wallpaper(self, directory, image_path);
+        free(image_path);
+        if (!wallpaper)
+            goto out;
+        if (PyList_Append(wallpapers, wallpaper)) {
+            Py_DECREF(wallpaper);
+            goto out;
+        }
+        Py_DECREF(wallpaper);
+        if (!lazy)
+            render_slots(self, (Wallpaper*) wallpaper, NULL);
+    }
 
-static PyObject *OWallpaperD_getwallpapers(OWallpaperD *self, PyObject *value,
-                                           void *closure)
-{
-    Py_INCREF(self->wallpapers);
-    return self->wallpapers;
-}
+    /* Wait for the renders to finish */
+    for (i = 0; i < PyList_GET_SIZE(wallpapers); ++i) {
+        Wallpaper *wallpaper = (Wallpaper*) PyList_GET_ITEM(wallpapers, i);
+        for (j = 0; j < self->num_slots; ++j) {
+            while (wallpaper->pending[j]) {
+                struct pollfd pollfd;
+                int ret;
 
-static PyObject *OWallpaperD_getnum_screens(OWallpaperD *self, PyObject *value,
-                                            void *closure)
-{
-    return PyLong_FromSsize_t(self->num_screens);
-}
+                pollfd.fd = self->render_queue->event_fd;
+                pollfd.events = POLLIN;
+                Py_BEGIN_ALLOW_THREADS
+                ret = poll(&pollfd, 1, -1);
+                Py_END_ALLOW_THREADS
+                if (ret == -1 && errno == EINTR && PyErr_CheckSignals())
+                    goto out;
+                reap_renders(self);
+            }
+        }
+    }
 
-static PyGetSetDef OWallpaperD_getset[] = {
-    {"wallpapers",
-     (getter) OWallpaperD_getwallpapers, NULL,
-     "List of currently loaded wallpapers.", NULL},
-    {"num_screens",
-     (getter) OWallpaperD_getnum_screens, NULL,
-     "Number of Xinerama screens.", NULL},
-    {NULL}
-};
+    /* Add everything that was rendered, skipping files which aren't images */
+    added = PyList_New(0);
+    if (!added)
+        goto out;
+    for (i = 0; i < PyList_GET_SIZE(wallpapers); ++i) {
+        Wallpaper *wallpaper = (Wallpaper*) PyList_GET_ITEM(wallpapers, i);
+        int rendered = 1;
 
-static PyObject *OWallpaperD_wait_for_workspace_change(OWallpaperD *self)
-{
-    Display *display;
-    int screen;
+        for (j = 0; !lazy && j < self->num_slots; ++j) {
+            if (!wallpaper->pixmaps[j])
+                rendered = 0;
+        }
+        if (!rendered)
+            continue;
+
+        if (publish_wallpaper(self, wallpaper) ||
+            PyList_Append(added, (PyObject*) wallpaper)) {
+            Py_CLEAR(added);
+            goto out;
+        }
+    }
+
+out:
+    for (i = 0; i < num_names; ++i)
+        free(names[i]);
+    free(names);
+    Py_XDECREF(wallpapers);
+    return added;
+
+err:
+    free(directory->path);
+    Py_XDECREF(directory->kwds);
+    PyMem_Free(directory);
+    inotify_rm_watch(self->inotify_fd, wd);
+    return NULL;
+}
 
-    Atom OWALLPAPERD_WORKSPACES;
+static PyObject *OWallpaperD_wait_for_workspace_change(OWallpaperD *self,
+                                                       PyObject *args,
+                                                       PyObject *kwds)
+{
+    Connection *connection;
     XEvent event;
-    Time currentTime;
+    Time *start_times;
 
-    long *workspaces;
-    Py_ssize_t i;
-    PyObject *workspaces_tuple;
+    int coalesce = 0;
+    double debounce = 0.0;
+    char *changed;
+    int debounce_window, ready, coalesced, status = 0, interrupted = 0;
+
+    Py_ssize_t c, i;
+    PyObject *workspaces_tuple, *changed_tuple, *ret;
 
-    display = self->display;
-    screen = self->screen;
+    static char *kwlist[] = {"coalesce", "debounce", NULL};
 
-    OWALLPAPERD_WORKSPACES =
-        XInternAtom(display, "OWALLPAPERD_WORKSPACES", True);
-    if (OWALLPAPERD_WORKSPACES == None) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pd", kwlist,
+                                     &coalesce, &debounce))
+        return NULL;
+    debounce_window = debounce_ms(debounce);
+    if (debounce_window == -1)
+        return NULL;
+
+    /* Only one caller may consume the events and use the poll set */
+    if (self->running) {
+        PyErr_SetString(OWallpaperDError,
+                        "cannot wait for workspace changes while running");
+        return NULL;
+    }
+    if (self->waiting) {
         PyErr_SetString(OWallpaperDError,
-                        "could not intern OWALLPAPERD_WORKSPACES atom");
+                        "already waiting for workspace changes");
         return NULL;
     }
 
+    start_times = PyMem_New(Time, self->num_connections);
+    changed = PyMem_New(char, self->num_screens);
+    if (!start_times || !changed) {
+        PyMem_Free(start_times);
+        PyMem_Free(changed);
+        return PyErr_NoMemory();
+    }
+
     /*
      * We only want events that happen after this function is called, so get
-     * the current time to compare against
+     * the current time on each X server to compare against
      */
-    currentTime = get_current_time(display, screen);
-    if (!currentTime) {
-        PyErr_SetString(OWallpaperDError,
-                        "could not get current X server time");
-        return NULL;
+    for (c = 0; c < self->num_connections; ++c) {
+        connection = &self->connections[c];
+        start_times[c] = get_current_time(connection->display,
+                                          connection->screen);
+        if (!start_times[c]) {
+            PyErr_SetString(OWallpaperDError,
+                            "could not get current X server time");
+            PyMem_Free(start_times);
+            PyMem_Free(changed);
+            return NULL;
+        }
     }
 
-    for (;;) {
-        XNextEvent(display, &event);
-        if (event.type == PropertyNotify &&
-            event.xproperty.atom == OWALLPAPERD_WORKSPACES &&
-            event.xproperty.time > currentTime)
-        {
-            int changed = 0;
-            workspaces = get_workspaces(display, screen, self->num_screens);
-            if (!workspaces) {
-                PyErr_SetString(OWallpaperDError,
-                                "could not get current workspaces");
-                goto errout;
-            }
+    /* Only release the GIL while waiting, since it protects our state */
+    self->waiting = 1;
+    while (!status && !interrupted) {
+        Py_BEGIN_ALLOW_THREADS
+        ready = poll_events(self);
+        Py_END_ALLOW_THREADS
+        if (ready == -1) {
+            if (PyErr_CheckSignals())
+                break;
+            continue;
+        }
+
+        /* Keep up with background renders and watched directories */
+        if (ready & EVENT_RENDER)
+            reap_renders(self);
+        if (ready & EVENT_WATCH)
+            process_directory_changes(self);
 
-            /* Make sure the workspaces have actually changed */
-            for (i = 0; i < self->num_screens; ++i) {
-                if (workspaces[i] != self->workspaces[i]) {
-                    changed = 1;
-                    self->workspaces[i] = workspaces[i];
+        if (!(ready & EVENT_X))
+            continue;
+        for (c = 0; c < self->num_connections && !status; ++c) {
+            connection = &self->connections[c];
+            while (XPending(connection->display)) {
+                XNextEvent(connection->display, &event);
+                if (event.type != PropertyNotify ||
+                    event.xproperty.atom != connection->workspaces_atom ||
+                    event.xproperty.time <= start_times[c])
+                    continue;
+
+                if (coalesce) {
+                    Py_BEGIN_ALLOW_THREADS
+                    coalesced = coalesce_workspace_events(
+                        connection->display, connection->workspaces_atom,
+                        debounce_window);
+                    Py_END_ALLOW_THREADS
+                    if (coalesced == -1 && PyErr_CheckSignals()) {
+                        interrupted = 1;
+                        break;
+                    }
                 }
+
+                /* Make sure the workspaces have actually changed */
+                status = update_workspaces(self, changed);
+                if (status)
+                    break;
             }
-            XFree(workspaces);
-            if (changed)
+            if (interrupted)
                 break;
         }
     }
+    self->waiting = 0;
+    PyMem_Free(start_times);
+
+    if (status != 1) {
+        if (status == -1)
+            PyErr_SetString(OWallpaperDError,
+                            "could not get current workspaces");
+        PyMem_Free(changed);
+        return NULL;
+    }
 
     /* Make the tuple to return out to Python-land */
+    ret = NULL;
+    changed_tuple = NULL;
     workspaces_tuple = PyTuple_New(self->num_screens);
     if (!workspaces_tuple)
-        return NULL;
+        goto out;
     for (i = 0; i < self->num_screens; ++i) {
         PyObject *workspace;
         workspace = PyLong_FromLong(self->workspaces[i]);
-        if (!workspace) {
-            Py_DECREF(workspaces_tuple);
-            return NULL;
-        }
+        if (!workspace)
+            goto out;
         PyTuple_SET_ITEM(workspaces_tuple, i, workspace);
     }
-    return workspaces_tuple;
-
-errout:
-    if (workspaces)
-        XFree(workspaces);
-    return NULL;
-}
-
-static PyObject *OWallpaperD_add_wallpaper(OWallpaperD *self, PyObject *args,
-                                           PyObject *kwds)
-{
-    PyObject *wallpaper;
-    Py_ssize_t num_args;
-    PyObject *new_args = NULL;
-    Py_ssize_t i;
-    int success = 1;
-
-    num_args = PyTuple_GET_SIZE(args) + 1;
-    new_args = PyTuple_New(num_args);
-
-    if (!new_args) {
-        success = 0;
-        goto out;
-    }
-
-    Py_INCREF(self);
-    PyTuple_SET_ITEM(new_args, 0, (PyObject*) self);
-    for (i = 1; i < num_args; ++i) {
-        PyObject *arg = PyTuple_GET_ITEM(args, i - 1);
-        Py_INCREF(arg);
-        PyTuple_SET_ITEM(new_args, i, arg);
-    }
 
-    wallpaper = PyObject_Call((PyObject*) &WallpaperType, new_args, kwds);
-    if (!wallpaper) {
-        success = 0;
+    if (!coalesce) {
+        ret = workspaces_tuple;
+        workspaces_tuple = NULL;
         goto out;
     }
 
-    if (PyList_Append(self->wallpapers, wallpaper) == -1) {
-        success = 0;
+    changed_tuple = PyTuple_New(self->num_screens);
+    if (!changed_tuple)
         goto out;
+    for (i = 0; i < self->num_screens; ++i) {
+        PyObject *screen_changed = PyBool_FromLong(changed[i]);
+        PyTuple_SET_ITEM(changed_tuple, i, screen_changed);
     }
+    ret = PyTuple_Pack(2, workspaces_tuple, changed_tuple);
 
 out:
-    Py_XDECREF(new_args);
-    if (success)
-        return wallpaper;
-    else
-        return NULL;
-    Py_RETURN_NONE;
+    Py_XDECREF(workspaces_tuple);
+    Py_XDECREF(changed_tuple);
+    PyMem_Free(changed);
+    return ret;
 }
 
-static PyObject *OWallpaperD_set_wallpaper(OWallpaperD *self, PyObject *args)
+static PyObject *OWallpaperD_run(OWallpaperD *self, PyObject *args,
+                                 PyObject *kwds)
 {
-    PyObject *wallpaper_o;
-    Wallpaper *wallpaper;
+    Connection *connection;
+    XEvent event;
+    char *changed;
+    Py_ssize_t c, i;
+    int debounce_window, ready, coalesced, status, error = 0;
+    double debounce = 0.0;
+    struct itimerspec timer;
 
-    Display *display;
-    int xinerama_screen;
-    Window window;
-    Pixmap pixmap;
+    static char *kwlist[] = {"debounce", NULL};
 
-    if (!PyArg_ParseTuple(args, "iO", &xinerama_screen, &wallpaper_o))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|d", kwlist, &debounce))
         return NULL;
-
-    if (!PyObject_TypeCheck(wallpaper_o, &WallpaperType)) {
-        PyErr_SetString(OWallpaperDError,
-                        "first argument must be a Wallpaper object");
+    debounce_window = debounce_ms(debounce);
+    if (debounce_window == -1)
         return NULL;
-    } else
-        wallpaper = (Wallpaper*) wallpaper_o;
 
-    /*
-     * If the display, screen, and number of Xinerama screens for the given
-     * Wallpaper don't match with our members, then we can't use this Wallpaper
-     * object
-     */
-    if (wallpaper->display != self->display ||
-        wallpaper->screen != self->screen ||
-        wallpaper->num_screens != self->num_screens)
-    {
+    for (i = 0; i < self->num_screens; ++i) {
+        if (self->slideshows[i].wallpapers)
+            break;
+    }
+    if (self->policy == POLICY_NONE && i == self->num_screens) {
+        PyErr_SetString(OWallpaperDError, "no policy or slideshow set");
+        return NULL;
+    }
+    if (self->running) {
+        PyErr_SetString(OWallpaperDError, "already running");
+        return NULL;
+    }
+    if (self->waiting) {
         PyErr_SetString(OWallpaperDError,
-                        "Wallpaper was not created for this OWallpaperD");
+                        "cannot run while waiting for workspace changes");
         return NULL;
     }
 
-    if (xinerama_screen >= self->num_screens) {
-        PyErr_SetString(PyExc_IndexError, "screen out of bounds");
+    if (self->handed_off) {
+        PyErr_SetString(OWallpaperDError, "already handed off");
         return NULL;
     }
 
-    display = self->display;
-    window = self->windows[xinerama_screen];
-    pixmap = wallpaper->pixmaps[xinerama_screen];
+    /* The modulo policy works on a snapshot of the wallpapers list */
+    if (refresh_policy_table(self))
+        return NULL;
 
-    /* Actually set the wallpaper */
-    XKillClient(display, AllTemporary);
-    XSetCloseDownMode(display, RetainTemporary);
+    /* Anything from the previous instance not adopted by now isn't needed */
+    release_handoff(self);
 
-    XSetWindowBackgroundPixmap(display, window, pixmap);
-    XClearWindow(display, window);
+    changed = PyMem_New(char, self->num_screens);
+    if (!changed)
+        return PyErr_NoMemory();
 
-    XFlush(display);
-    XSync(display, False);
+    self->running = 1;
 
-    Py_RETURN_NONE;
+    /* Set the wallpapers for the current workspaces before waiting */
+    status = update_workspaces(self, NULL) == -1 ? 0 : 1;
+    for (i = 0; i < self->num_screens; ++i)
+        changed[i] = 1;
+    slideshow_start(self);
+
+    /*
+     * The GIL protects our state from other Python threads (e.g., calling
+     * set_wallpaper()), so it's only released while waiting
+     */
+    for (;;) {
+        if (status == 1 && self->policy != POLICY_NONE &&
+            apply_policy(self, changed))
+            break;
+        status = 0;
+
+        slideshow_arm_timer(self);
+        Py_BEGIN_ALLOW_THREADS
+        ready = poll_events(self);
+        Py_END_ALLOW_THREADS
+        if (ready == -1) {
+            if (PyErr_CheckSignals())
+                break;
+            continue;
+        }
+
+        if (ready & EVENT_RENDER)
+            reap_renders(self);
+        if (ready & EVENT_WATCH)
+            process_directory_changes(self);
+
+        if (ready & EVENT_TIMER) {
+            uint64_t expirations;
+            double now = monotonic_time();
+
+            if (read(self->timer_fd, &expirations,
+                     sizeof(expirations)) == -1) {
+                /* EAGAIN if the timer was re-armed in the meantime */
+            }
+            if (slideshow_tick(self, now))
+                slideshow_prerender(self, now);
+            flush_connections(self);
+        }
+
+        if (!(ready & EVENT_X))
+            continue;
+        for (c = 0; c < self->num_connections && !status; ++c) {
+            connection = &self->connections[c];
+            while (XPending(connection->display)) {
+                XNextEvent(connection->display, &event);
+                if (event.type != PropertyNotify ||
+                    event.xproperty.atom != connection->workspaces_atom)
+                    continue;
+
+                /* Only render the final state of a burst of changes */
+                Py_BEGIN_ALLOW_THREADS
+                coalesced = coalesce_workspace_events(
+                    connection->display, connection->workspaces_atom,
+                    debounce_window);
+                Py_END_ALLOW_THREADS
+                if (coalesced == -1 && PyErr_CheckSignals()) {
+                    error = -1;
+                    break;
+                }
+
+                /*
+                 * The window manager may briefly remove the property (e.g.,
+                 * while restarting), so just wait for the next change if we
+                 * can't read it
+                 */
+                status = update_workspaces(self, changed);
+                break;
+            }
+            if (error)
+                break;
+        }
+        if (error)
+            break;
+    }
+
+    /* Slideshows only run inside of run(), so stop the timer */
+    memset(&timer, 0, sizeof(timer));
+    timerfd_settime(self->timer_fd, 0, &timer, NULL);
+
+    self->running = 0;
+    PyMem_Free(changed);
+    return NULL;
 }
 
 static PyMethodDef OWallpaperD_methods[] = {
+    {"handoff",
+     (PyCFunction) OWallpaperD_handoff, METH_NOARGS,
+"Hand off the desktop windows and rendered wallpapers to the next daemon\n"
+"instance instead of destroying them, e.g., before restarting. The rendered\n"
+"pixmaps are listed on a desktop window, which the root window points to,\n"
+"along with the image path, modification time, mode, background color, and\n"
+"screen geometry they were rendered for; a new OWallpaperD adopts matching\n"
+"ones instead of rendering them again. It only trusts listings on windows\n"
+"with the OWallpaperD window class. This object can't be used afterwards.\n"
+"Returns the number of pixmaps published."
+    },
+    {"release_handoff",
+     (PyCFunction) OWallpaperD_release_handoff, METH_NOARGS,
+"Free the pixmaps handed off by the previous instance which haven't been\n"
+"adopted by a Wallpaper. This is done automatically by run()."
+    },
     {"wait_for_workspace_change",
-     (PyCFunction) OWallpaperD_wait_for_workspace_change, METH_NOARGS,
+     (PyCFunction) OWallpaperD_wait_for_workspace_change,
+     METH_VARARGS | METH_KEYWORDS,
 "Block until the workspace changes on a Xinerama screen and return a tuple\n"
-"containing the workspace number for each Xinerama screen."
+"containing the workspace number for each Xinerama screen.\n"
+"\n"
+"Keyword arguments:\n"
+"coalesce -- collapse a burst of changes into one, returning a tuple of the\n"
+"final workspaces and a tuple of whether each screen's workspace changed\n"
+"debounce -- with coalesce, seconds to wait for further changes before\n"
+"returning"
     },
     {"add_wallpaper",
      (PyCFunction) OWallpaperD_add_wallpaper, METH_VARARGS | METH_KEYWORDS,
@@ -309,12 +2934,73 @@ static PyMethodDef OWallpaperD_methods[] = {
     "image -- the path of the wallpaper\n"
     "mode -- mode for rendering wallpaper on screen ('center', 'fill, 'full',\n"
     "or 'tile')\n"
-    "background_color -- background color when rendering"
+    "background_color -- background color when rendering\n"
+    "lazy -- don't render the wallpaper until it is needed\n"
+    "cached -- keep the rendered wallpaper in the image cache (see\n"
+    "set_cache_budget()) instead of as X pixmaps, unless it doesn't fit"
+    },
+    {"add_wallpaper_directory",
+     (PyCFunction) OWallpaperD_add_wallpaper_directory,
+     METH_VARARGS | METH_KEYWORDS,
+    "Load every image in a directory in parallel and keep the wallpapers list\n"
+    "up to date as files are added, modified, and removed. Changes are loaded\n"
+    "in the background while run() or wait_for_workspace_change() is waiting.\n"
+    "Returns the list of wallpapers which were loaded.\n"
+    "\n"
+    "Keyword arguments:\n"
+    "path -- the path of the directory\n"
+    "mode -- mode for rendering wallpapers on screen ('center', 'fill',\n"
+    "'full', or 'tile')\n"
+    "background_color -- background color when rendering\n"
+    "lazy -- don't render wallpapers until they are needed; files are only\n"
+    "checked to be images\n"
+    "cached -- keep the rendered wallpapers in the image cache instead of as\n"
+    "X pixmaps"
     },
     {"set_wallpaper",
-     (PyCFunction) OWallpaperD_set_wallpaper, METH_VARARGS,
+     (PyCFunction) OWallpaperD_set_wallpaper, METH_VARARGS | METH_KEYWORDS,
 "Set the current wallpaper on a given Xinerama screen to the given Wallpaper\n"
-"object."
+"object.\n"
+"\n"
+"If progressive is true and the wallpaper hasn't been rendered for the\n"
+"screen yet, a quick preview is shown first and the full-quality version is\n"
+"swapped in once it has been rendered in the background."
+    },
+    {"set_policy",
+     (PyCFunction) OWallpaperD_set_policy, METH_VARARGS,
+"Set the policy which run() uses to pick the wallpaper for a workspace.\n"
+"\n"
+"The policy may be 'modulo' (use wallpapers[workspace % len(wallpapers)]),\n"
+"a sequence or dict mapping workspace numbers to Wallpaper objects, a\n"
+"callable taking the Xinerama screen and workspace and returning a\n"
+"Wallpaper or None, or None to clear the policy."
+    },
+    {"run",
+     (PyCFunction) OWallpaperD_run, METH_VARARGS | METH_KEYWORDS,
+"Set wallpapers according to the policy whenever the workspace changes.\n"
+"\n"
+"Bursts of workspace changes are coalesced so that only the final state is\n"
+"rendered; the debounce keyword argument gives the number of seconds to\n"
+"wait for further changes.\n"
+"\n"
+"The event loop releases the GIL while it waits for events and only calls\n"
+"back into Python for callable policies. It returns only when interrupted\n"
+"by an exception, e.g., KeyboardInterrupt or an exception raised by the\n"
+"policy."
+    },
+    {"set_slideshow",
+     (PyCFunction) OWallpaperD_set_slideshow, METH_VARARGS | METH_KEYWORDS,
+"Cycle through wallpapers on a Xinerama screen while run() is executing.\n"
+"\n"
+"Keyword arguments:\n"
+"screen -- the Xinerama screen\n"
+"interval -- seconds between wallpapers, or 0 to stop the slideshow\n"
+"wallpapers -- sequence of Wallpaper objects (default: all wallpapers)\n"
+"\n"
+"Lazy wallpapers are rendered in the background ahead of each switch.\n"
+"Wallpapers which fail to render are skipped; if none of them can be\n"
+"rendered, the slideshow waits an interval before trying again. Screens\n"
+"running a slideshow ignore the workspace policy."
     },
     {NULL}
 };
@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "render_queue.h"
+
+/* See render_queue.h. */
+RenderJob *render_job_new(Display *display, int screen, Window window,
+                          XineramaScreenInfo *info, const char *image_path,
+                          WallpaperMode mode, unsigned long background_color,
+                          int use_cache)
+{
+    RenderJob *job;
+
+    job = calloc(1, sizeof(*job));
+    if (!job)
+        return NULL;
+
+    job->image_path = strdup(image_path);
+    if (!job->image_path) {
+        free(job);
+        return NULL;
+    }
+
+    job->display = display;
+    job->screen = screen;
+    job->window = window;
+    job->info = *info;
+    job->mode = mode;
+    job->background_color = background_color;
+    job->use_cache = use_cache;
+    return job;
+}
+
+/* See render_queue.h. */
+void render_job_free(RenderJob *job)
+{
+    free(job->image_path);
+    free(job);
+}
+
+static void *render_thread(void *arg)
+{
+    RenderQueue *queue = arg;
+    RenderJob *job, *member, *group;
+    uint64_t one = 1;
+    double start;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (!queue->stopping && !queue->pending_head)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        if (queue->stopping)
+            break;
+
+        job = queue->pending_head;
+        queue->pending_head = job->next;
+        if (!queue->pending_head)
+            queue->pending_tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        for (member = job; member; member = member->group) {
+            start = monotonic_time();
+            member->error = create_wallpaper(member->display, member->screen,
+                                             member->window, &member->info,
+                                             member->image_path, member->mode,
+                                             member->background_color,
+                                             member->use_cache,
+                                             &member->pixmap);
+            member->render_time = monotonic_time() - start;
+
+            /* Get the image to the server ahead of time */
+            if (!member->error)
+                XFlush(member->display);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        for (member = job; member; member = group) {
+            group = member->group;
+            member->group = NULL;
+            member->next = queue->finished;
+            queue->finished = member;
+        }
+        if (write(queue->event_fd, &one, sizeof(one)) == -1) {
+            /* The counter can't overflow in practice, so just ignore this */
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/* See render_queue.h. */
+int render_queue_init(RenderQueue *queue, int max_threads)
+{
+    memset(queue, 0, sizeof(*queue));
+
+    queue->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (queue->event_fd == -1)
+        return errno;
+
+    queue->threads = calloc(max_threads, sizeof(pthread_t));
+    if (!queue->threads) {
+        close(queue->event_fd);
+        return ENOMEM;
+    }
+    queue->max_threads = max_threads;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    return 0;
+}
+
+/* See render_queue.h. */
+RenderJob *render_queue_destroy(RenderQueue *queue)
+{
+    RenderJob *leftover, *job, *member;
+    int i;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (i = 0; i < queue->num_threads; ++i)
+        pthread_join(queue->threads[i], NULL);
+
+    leftover = queue->finished;
+    while ((job = queue->pending_head)) {
+        queue->pending_head = job->next;
+        while (job) {
+            member = job;
+            job = job->group;
+            member->group = NULL;
+            member->error = ECANCELED;
+            member->next = leftover;
+            leftover = member;
+        }
+    }
+
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->threads);
+    close(queue->event_fd);
+    return leftover;
+}
+
+/* See render_queue.h. */
+int render_queue_submit(RenderQueue *queue, RenderJob *job)
+{
+    int error = 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    /* Start the worker threads the first time that they're needed */
+    while (queue->num_threads < queue->max_threads) {
+        error = pthread_create(&queue->threads[queue->num_threads], NULL,
+                               render_thread, queue);
+        if (error)
+            break;
+        ++queue->num_threads;
+    }
+    if (queue->num_threads == 0)
+        goto out;
+    error = 0;
+
+    job->next = NULL;
+    if (queue->pending_tail)
+        queue->pending_tail->next = job;
+    else
+        queue->pending_head = job;
+    queue->pending_tail = job;
+    pthread_cond_signal(&queue->cond);
+
+out:
+    pthread_mutex_unlock(&queue->lock);
+    return error;
+}
+
+/* See render_queue.h. */
+RenderJob *render_queue_take_finished(RenderQueue *queue)
+{
+    RenderJob *finished;
+    uint64_t count;
+
+    pthread_mutex_lock(&queue->lock);
+    finished = queue->finished;
+    queue->finished = NULL;
+    if (read(queue->event_fd, &count, sizeof(count)) == -1) {
+        /* EAGAIN just means that the counter was already zero */
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return finished;
+}
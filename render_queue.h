@@ -0,0 +1,106 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <pthread.h>
+#include "helper.h"
+
+/** A wallpaper to render for one Xinerama screen on a background thread. */
+typedef struct RenderJob {
+    struct RenderJob *next;
+
+    /**
+     * Jobs for the same wallpaper on other X screens with the same geometry,
+     * linked by group. They're rendered by the same thread right after this
+     * one so that they can reuse its canvas, and are then finished separately.
+     */
+    struct RenderJob *group;
+
+    /** Arguments for create_wallpaper(). */
+    Display *display;
+    int screen;
+    Window window;
+    XineramaScreenInfo info;
+    char *image_path;
+    WallpaperMode mode;
+    unsigned long background_color;
+    int use_cache;
+
+    /** Opaque data for the submitter. */
+    void *data;
+
+    /** Xinerama screen index for the submitter. */
+    long index;
+
+    /** Rendered pixmap, or None if rendering failed. */
+    Pixmap pixmap;
+
+    /** Return value of create_wallpaper(). */
+    int error;
+
+    /** Time taken by create_wallpaper() in seconds. */
+    double render_time;
+} RenderJob;
+
+/**
+ * A pool of background threads rendering wallpapers. Finished jobs are
+ * collected with render_queue_take_finished(); the queue's event file
+ * descriptor is readable whenever there are finished jobs, so it can be polled
+ * alongside the X connection.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /** Jobs waiting for a thread. */
+    RenderJob *pending_head, *pending_tail;
+
+    /** Jobs which have been rendered. */
+    RenderJob *finished;
+
+    /** eventfd which is readable when there are finished jobs. */
+    int event_fd;
+
+    /** Worker threads, started on the first submission. */
+    pthread_t *threads;
+    int num_threads, max_threads;
+
+    /** Set when the worker threads should exit. */
+    int stopping;
+} RenderQueue;
+
+/**
+ * Allocate a render job. The image path is copied.
+ * @return The job, or NULL if we ran out of memory.
+ */
+RenderJob *render_job_new(Display *display, int screen, Window window,
+                          XineramaScreenInfo *info, const char *image_path,
+                          WallpaperMode mode, unsigned long background_color,
+                          int use_cache);
+
+/** Free a render job (but not its pixmap). */
+void render_job_free(RenderJob *job);
+
+/**
+ * Initialize a render queue.
+ * @param max_threads Maximum number of worker threads.
+ * @return Zero on success, errno on failure.
+ */
+int render_queue_init(RenderQueue *queue, int max_threads);
+
+/**
+ * Stop the worker threads and free the queue.
+ * @return List of jobs which were pending or finished but not yet taken, so
+ * that the caller can free their data and pixmaps.
+ */
+RenderJob *render_queue_destroy(RenderQueue *queue);
+
+/**
+ * Queue a job, along with its group, to be rendered on a background thread.
+ * @return Zero on success, errno on failure.
+ */
+int render_queue_submit(RenderQueue *queue, RenderJob *job);
+
+/** Take the list of finished jobs (linked by next), or NULL if none. */
+RenderJob *render_queue_take_finished(RenderQueue *queue);
+
+#endif /* RENDER_QUEUE_H */
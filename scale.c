@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "scale.h"
+
+/** Filter weights are fixed-point with this many fractional bits. */
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+/** Don't bother splitting up images with fewer output rows than this. */
+#define MIN_BAND_ROWS 16
+
+static int scale_threads;
+
+/**
+ * Persistent threads which scale bands for scale_blend_image(). They're
+ * started as they're first needed and then kept for the life of the process,
+ * since starting threads for every render costs more than small bands take.
+ */
+static struct {
+    pthread_mutex_t lock;
+
+    /** Signalled when bands are queued, and when the last one is done. */
+    pthread_cond_t work, done;
+
+    /** Number of threads started. */
+    int num_threads;
+
+    /** Bands of the current image, and how many are taken and unfinished. */
+    struct Band *bands;
+    int num_bands, next_band, unfinished;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, 0, NULL, 0, 0, 0
+};
+
+/** Serializes the images scaled by the pool. */
+static pthread_mutex_t pool_image_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Source pixels contributing to one output pixel along one axis. */
+typedef struct {
+    int first;
+    int count;
+
+    /** Index of the first weight in the filter's weight array. */
+    int weights;
+} Taps;
+
+/** Filter for scaling along one axis. */
+typedef struct {
+    Taps *taps;
+    uint16_t *weights;
+
+    /** Largest number of taps for any output pixel. */
+    int max_taps;
+} Filter;
+
+/** Shared state for scaling one image. */
+typedef struct {
+    const uint32_t *src;
+    int src_width, src_height, src_has_alpha;
+    uint32_t *dst;
+    int dst_width;
+
+    /** Position and size of the scaled image on the canvas. */
+    int x, y, width, height;
+
+    /** Clipped range of output columns, relative to x. */
+    int col_start, col_end;
+
+    Filter horizontal, vertical;
+} ScaleJob;
+
+/** A band of output rows, relative to y. */
+typedef struct Band {
+    const ScaleJob *job;
+    int row_start, row_end;
+    int error;
+} Band;
+
+static void filter_free(Filter *filter)
+{
+    free(filter->taps);
+    free(filter->weights);
+}
+
+/**
+ * Build the filter for scaling n source pixels to m output pixels. Each
+ * output pixel's weights sum to exactly WEIGHT_ONE.
+ */
+static int filter_init(Filter *filter, int n, int m)
+{
+    int d, s, count, total, cumulative;
+    long long start, end, hi;
+
+    filter->taps = malloc(sizeof(Taps) * m);
+    /* A box filter covers at most n / m + 2 source pixels */
+    filter->weights = malloc(sizeof(uint16_t) * m * (n / m + 2));
+    if (!filter->taps || !filter->weights) {
+        filter_free(filter);
+        return ENOMEM;
+    }
+
+    filter->max_taps = 0;
+    count = 0;
+    for (d = 0; d < m; ++d) {
+        Taps *taps = &filter->taps[d];
+        uint16_t *weights = &filter->weights[count];
+
+        taps->weights = count;
+        if (m < n) {
+            /*
+             * Box filter: output pixel d covers [d * n, (d + 1) * n) in units
+             * of 1 / m source pixels
+             */
+            start = (long long) d * n;
+            end = start + n;
+            taps->first = (int) (start / m);
+            taps->count = 0;
+            total = 0;
+            for (s = taps->first; (long long) s * m < end; ++s) {
+                hi = (long long) (s + 1) * m < end ? (long long) (s + 1) * m :
+                                                     end;
+                /*
+                 * Round the running total rather than each weight, so that
+                 * every tap is within half a unit of its exact weight and the
+                 * last one ends at exactly WEIGHT_ONE
+                 */
+                cumulative = (int) (((hi - start) * WEIGHT_ONE + n / 2) / n);
+                weights[taps->count] = (uint16_t) (cumulative - total);
+                total = cumulative;
+                taps->count++;
+            }
+        } else {
+            /*
+             * Bilinear filter: the center of output pixel d is at
+             * ((2d + 1) * n - m) / 2m in source coordinates
+             */
+            long long num = (long long) (2 * d + 1) * n - m;
+            long long den = 2LL * m;
+            int w1;
+
+            if (num < 0) {
+                taps->first = 0;
+                w1 = 0;
+            } else {
+                taps->first = (int) (num / den);
+                w1 = (int) (((num % den) * WEIGHT_ONE + den / 2) / den);
+            }
+            if (taps->first >= n - 1) {
+                taps->first = n - 1;
+                w1 = 0;
+            }
+            taps->count = w1 ? 2 : 1;
+            weights[0] = (uint16_t) (WEIGHT_ONE - w1);
+            if (w1)
+                weights[1] = (uint16_t) w1;
+        }
+        count += taps->count;
+        if (taps->count > filter->max_taps)
+            filter->max_taps = taps->count;
+    }
+    return 0;
+}
+
+/**
+ * Scale one source row horizontally into per-channel accumulators: the color
+ * channels are premultiplied by alpha and have 16 significant bits, and alpha
+ * has 8 fractional bits.
+ */
+static void scale_row(const ScaleJob *job, int src_row, uint32_t *out)
+{
+    const uint32_t *row = job->src + (size_t) src_row * job->src_width;
+    const Filter *filter = &job->horizontal;
+    int col, i;
+
+    for (col = job->col_start; col < job->col_end; ++col) {
+        const Taps *taps = &filter->taps[col];
+        const uint16_t *weights = &filter->weights[taps->weights];
+        uint32_t a = 0, r = 0, g = 0, b = 0;
+
+        for (i = 0; i < taps->count; ++i) {
+            uint32_t pixel = row[taps->first + i];
+            uint32_t alpha = job->src_has_alpha ? pixel >> 24 : 0xff;
+            uint32_t weight = weights[i];
+
+            a += alpha * weight;
+            r += ((pixel >> 16) & 0xff) * alpha * weight;
+            g += ((pixel >> 8) & 0xff) * alpha * weight;
+            b += (pixel & 0xff) * alpha * weight;
+        }
+
+        out[4 * (col - job->col_start) + 0] = a >> (WEIGHT_BITS - 8);
+        out[4 * (col - job->col_start) + 1] = r >> WEIGHT_BITS;
+        out[4 * (col - job->col_start) + 2] = g >> WEIGHT_BITS;
+        out[4 * (col - job->col_start) + 3] = b >> WEIGHT_BITS;
+    }
+}
+
+/** Blend a premultiplied channel over an opaque destination channel. */
+static uint32_t blend_channel(uint32_t premultiplied, uint32_t alpha,
+                              uint32_t dst)
+{
+    uint32_t value = (premultiplied + 127) / 255 +
+                     (dst * (255 - alpha) + 127) / 255;
+    return value > 255 ? 255 : value;
+}
+
+static void scale_band(Band *band)
+{
+    const ScaleJob *job = band->job;
+    const Filter *filter = &job->vertical;
+    int columns = job->col_end - job->col_start;
+    int ring_size = filter->max_taps + 1;
+    uint32_t *ring;
+    int *ring_rows;
+    int row, col, i;
+
+    /*
+     * Keep the horizontally scaled source rows around, since neighboring
+     * output rows share them
+     */
+    ring = malloc(sizeof(uint32_t) * 4 * columns * ring_size);
+    ring_rows = malloc(sizeof(int) * ring_size);
+    if (!ring || !ring_rows) {
+        free(ring);
+        free(ring_rows);
+        band->error = ENOMEM;
+        return;
+    }
+    for (i = 0; i < ring_size; ++i)
+        ring_rows[i] = -1;
+
+    for (row = band->row_start; row < band->row_end; ++row) {
+        const Taps *taps = &filter->taps[row];
+        const uint16_t *weights = &filter->weights[taps->weights];
+        uint32_t *dst = job->dst + (size_t) (job->y + row) * job->dst_width +
+                        job->x + job->col_start;
+        uint32_t *rows[ring_size];
+
+        for (i = 0; i < taps->count; ++i) {
+            int src_row = taps->first + i;
+            int slot = src_row % ring_size;
+
+            rows[i] = &ring[4 * columns * slot];
+            if (ring_rows[slot] != src_row) {
+                scale_row(job, src_row, rows[i]);
+                ring_rows[slot] = src_row;
+            }
+        }
+
+        for (col = 0; col < columns; ++col) {
+            uint32_t a = 0, r = 0, g = 0, b = 0;
+            uint32_t pixel = dst[col];
+
+            for (i = 0; i < taps->count; ++i) {
+                uint32_t weight = weights[i];
+                a += rows[i][4 * col + 0] * weight;
+                r += rows[i][4 * col + 1] * weight;
+                g += rows[i][4 * col + 2] * weight;
+                b += rows[i][4 * col + 3] * weight;
+            }
+            a = (a + (1 << (WEIGHT_BITS + 7))) >> (WEIGHT_BITS + 8);
+            r = (r + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+            g = (g + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+            b = (b + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+
+            dst[col] = 0xff000000 |
+                       blend_channel(r, a, (pixel >> 16) & 0xff) << 16 |
+                       blend_channel(g, a, (pixel >> 8) & 0xff) << 8 |
+                       blend_channel(b, a, pixel & 0xff);
+        }
+    }
+
+    free(ring);
+    free(ring_rows);
+}
+
+/** Take the next queued band, if any, and scale it. Called with pool.lock. */
+static int pool_scale_next_band(void)
+{
+    Band *band;
+
+    if (pool.next_band >= pool.num_bands)
+        return 0;
+    band = &pool.bands[pool.next_band++];
+
+    pthread_mutex_unlock(&pool.lock);
+    scale_band(band);
+    pthread_mutex_lock(&pool.lock);
+
+    if (--pool.unfinished == 0)
+        pthread_cond_signal(&pool.done);
+    return 1;
+}
+
+static void *pool_thread(void *arg)
+{
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool_scale_next_band())
+            pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    return NULL;
+}
+
+/**
+ * Start pool threads until there are at least num_threads. Called with
+ * pool.lock held. If a thread can't be started, the bands it would have taken
+ * are left to the others and the calling thread.
+ */
+static void pool_start_threads(int num_threads)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (pool.num_threads >= num_threads ||
+        pthread_attr_init(&attr))
+        return;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (pool.num_threads < num_threads &&
+           pthread_create(&thread, &attr, pool_thread, NULL) == 0)
+        pool.num_threads++;
+    pthread_attr_destroy(&attr);
+}
+
+/* See scale.h. */
+void set_scale_threads(int num_threads)
+{
+    scale_threads = num_threads;
+}
+
+/* See scale.h. */
+int scale_blend_image(const uint32_t *src, int src_width, int src_height,
+                      int src_has_alpha, uint32_t *dst, int dst_width,
+                      int dst_height, int x, int y, int width, int height)
+{
+    ScaleJob job;
+    Band *bands;
+    int num_threads, rows, row_start, row_end, i;
+    int error = 0;
+
+    if (src_width <= 0 || src_height <= 0 || width <= 0 || height <= 0)
+        return 0;
+
+    job.src = src;
+    job.src_width = src_width;
+    job.src_height = src_height;
+    job.src_has_alpha = src_has_alpha;
+    job.dst = dst;
+    job.dst_width = dst_width;
+    job.x = x;
+    job.y = y;
+    job.width = width;
+    job.height = height;
+
+    /* Clip to the canvas */
+    job.col_start = x < 0 ? -x : 0;
+    job.col_end = x + width > dst_width ? dst_width - x : width;
+    row_start = y < 0 ? -y : 0;
+    row_end = y + height > dst_height ? dst_height - y : height;
+    if (job.col_start >= job.col_end || row_start >= row_end)
+        return 0;
+
+    error = filter_init(&job.horizontal, src_width, width);
+    if (error)
+        return error;
+    error = filter_init(&job.vertical, src_height, height);
+    if (error) {
+        filter_free(&job.horizontal);
+        return error;
+    }
+
+    num_threads = scale_threads;
+    if (num_threads <= 0)
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    rows = row_end - row_start;
+    if (num_threads > rows / MIN_BAND_ROWS)
+        num_threads = rows / MIN_BAND_ROWS;
+    if (num_threads < 1)
+        num_threads = 1;
+
+    bands = calloc(num_threads, sizeof(Band));
+    if (!bands) {
+        error = ENOMEM;
+        goto out;
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        bands[i].job = &job;
+        bands[i].row_start = row_start + (int) ((long long) rows * i /
+                                                num_threads);
+        bands[i].row_end = row_start + (int) ((long long) rows * (i + 1) /
+                                              num_threads);
+    }
+
+    if (num_threads == 1)
+        scale_band(&bands[0]);
+    else {
+        /* The calling thread takes bands too, so it needs one fewer helper */
+        pthread_mutex_lock(&pool_image_lock);
+        pthread_mutex_lock(&pool.lock);
+        pool_start_threads(num_threads - 1);
+        pool.bands = bands;
+        pool.num_bands = num_threads;
+        pool.next_band = 0;
+        pool.unfinished = num_threads;
+        pthread_cond_broadcast(&pool.work);
+
+        while (pool_scale_next_band())
+            ;
+        while (pool.unfinished)
+            pthread_cond_wait(&pool.done, &pool.lock);
+
+        pool.bands = NULL;
+        pool.num_bands = pool.next_band = 0;
+        pthread_mutex_unlock(&pool.lock);
+        pthread_mutex_unlock(&pool_image_lock);
+    }
+
+    for (i = 0; i < num_threads; ++i) {
+        if (bands[i].error)
+            error = bands[i].error;
+    }
+
+out:
+    free(bands);
+    filter_free(&job.horizontal);
+    filter_free(&job.vertical);
+    return error;
+}
@@ -0,0 +1,29 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdint.h>
+
+/**
+ * Set the number of threads used to scale a single image, or zero to use one
+ * per online CPU. The output doesn't depend on the number of threads.
+ */
+void set_scale_threads(int num_threads);
+
+/**
+ * Scale an ARGB image and blend it onto a region of an opaque ARGB canvas. The
+ * destination rows are split into horizontal bands which are scaled in
+ * parallel; every output pixel is computed independently with integer
+ * arithmetic, so the result is identical for any number of threads. Box
+ * filtering is used for downscaling and bilinear filtering for upscaling.
+ * @param src Source image data, src_width * src_height pixels.
+ * @param src_has_alpha Whether to blend using the source alpha channel.
+ * @param dst Canvas data, dst_width * dst_height pixels.
+ * @param x, y, width, height Region of the canvas to scale the image to. Parts
+ * of the region which are outside of the canvas are clipped.
+ * @return Zero on success, non-zero on failure.
+ */
+int scale_blend_image(const uint32_t *src, int src_width, int src_height,
+                      int src_has_alpha, uint32_t *dst, int dst_width,
+                      int dst_height, int x, int y, int width, int height);
+
+#endif /* SCALE_H */
@@ -1,9 +1,10 @@
 from distutils.core import setup, Extension
 
 base_module = Extension('owallpaperd',
-        libraries=['X11', 'Xinerama', 'Imlib2'],
+        libraries=['X11', 'Xinerama', 'Imlib2', 'jpeg', 'lz4'],
         sources= ['owallpaperd_module.c', 'owallpaperd_object.c',
-                  'wallpaper_object.c', 'helper.c'])
+                  'wallpaper_object.c', 'helper.c', 'render_queue.c',
+                  'scale.c', 'image_cache.c'])
 
 setup (name = 'owallpaperd',
         version = '1.0',
@@ -1,16 +1,87 @@
+#include <sys/stat.h>
 #include "owallpaperd.h"
 
+/* See owallpaperd.h. */
+void set_render_error(int error)
+{
+    if (error == EINVAL)
+        PyErr_SetString(OWallpaperDError, "could not load image file");
+    else if (error == ENOMEM)
+        PyErr_NoMemory();
+    else if (error == ENOSYS)
+        PyErr_SetString(OWallpaperDError, "unimplemented wallpaper mode");
+    else
+        PyErr_SetString(OWallpaperDError, "unknown error loading wallpaper");
+}
+
+/* See owallpaperd.h. */
+int wallpaper_render(Wallpaper *wallpaper, OWallpaperD *owallpaperD,
+                     Py_ssize_t xinerama_screen)
+{
+    Connection *connection = SCREEN_CONNECTION(owallpaperD, xinerama_screen);
+    Py_ssize_t slot = owallpaperD->slots[xinerama_screen];
+    Pixmap pixmap;
+    double start;
+    int error;
+
+    if (wallpaper->pixmaps[slot])
+        return 0;
+
+    start = monotonic_time();
+    Py_BEGIN_ALLOW_THREADS
+    error = create_wallpaper(connection->display, connection->screen,
+                             owallpaperD->windows[xinerama_screen],
+                             &owallpaperD->screens[xinerama_screen],
+                             wallpaper->image_path, wallpaper->mode,
+                             wallpaper->background_color, wallpaper->cached,
+                             &pixmap);
+    Py_END_ALLOW_THREADS
+    if (error) {
+        owallpaperD->stats.render_errors++;
+        return error;
+    }
+    owallpaperD->stats.renders++;
+    owallpaperD->stats.render_time += monotonic_time() - start;
+
+    /* Another thread may have rendered it while we didn't hold the GIL */
+    if (wallpaper->pixmaps[slot])
+        XFreePixmap(connection->display, pixmap);
+    else
+        wallpaper->pixmaps[slot] = pixmap;
+    return 0;
+}
+
+/* See owallpaperd.h. */
+int wallpaper_in_cache(Wallpaper *wallpaper, OWallpaperD *owallpaperD,
+                       Py_ssize_t xinerama_screen)
+{
+    ImageKey key;
+
+    key.image_path = wallpaper->image_path;
+    key.mtime = wallpaper->mtime;
+    key.mode = wallpaper->mode;
+    key.background_color = wallpaper->background_color;
+    key.width = owallpaperD->screens[xinerama_screen].width;
+    key.height = owallpaperD->screens[xinerama_screen].height;
+    return image_cache_contains(&key);
+}
+
 static void Wallpaper_dealloc(Wallpaper *self)
 {
     Py_ssize_t i;
     if (self->pixmaps) {
-        for (i = 0; i < self->num_screens; ++i) {
+        for (i = 0; i < self->num_slots; ++i) {
             Pixmap pixmap = self->pixmaps[i];
             if (pixmap)
-                XFreePixmap(self->display, pixmap);
+                XFreePixmap(self->displays[i], pixmap);
         }
         PyMem_Free(self->pixmaps);
     }
+    if (self->pending)
+        PyMem_Free(self->pending);
+    if (self->displays)
+        PyMem_Free(self->displays);
+    free(self->image_path);
     Py_TYPE(self)->tp_free((PyObject*) self);
 }
 
@@ -19,18 +90,20 @@ static int Wallpaper_init(Wallpaper *self, PyObject *args, PyObject *kwds)
     Py_ssize_t i;
     PyObject *owallpaperD_o;
     OWallpaperD *owallpaperD;
+    struct stat st;
 
     const char *image_path;
     const char *mode_string = NULL;
-    WallpaperMode mode;
     uint32_t background_color = 0x0;
+    int lazy = 0;
+    int cached = 0;
 
     static char *kwlist[] = {"owallpaperD", "image", "mode",
-                             "background_color", NULL};
+                             "background_color", "lazy", "cached", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sI", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os|sIpp", kwlist,
                                      &owallpaperD_o, &image_path, &mode_string,
-                                     &background_color))
+                                     &background_color, &lazy, &cached))
         return -1;
 
     if (!PyObject_TypeCheck(owallpaperD_o, &OWallpaperDType)) {
@@ -40,46 +113,94 @@ static int Wallpaper_init(Wallpaper *self, PyObject *args, PyObject *kwds)
     }
 
     owallpaperD = (OWallpaperD*) owallpaperD_o;
-    self->display = owallpaperD->display;
-    self->screen = owallpaperD->screen;
-    self->num_screens = owallpaperD->num_screens;
+    self->num_slots = owallpaperD->num_slots;
 
-    mode = wallpaper_mode_from_string(mode_string);
-    if (mode == WALLPAPER_MODE_NONE) {
+    self->mode = wallpaper_mode_from_string(mode_string);
+    if (self->mode == WALLPAPER_MODE_NONE) {
         PyErr_SetString(OWallpaperDError,
-                        "unknown wallpaper mode (should be 'center', 'fill', 'full', or 'tile'");
+                        "unknown wallpaper mode "
+                        "(should be 'center', 'fill', 'full', or 'tile')");
+        return -1;
+    }
+    self->background_color = background_color;
+    self->cached = cached;
+
+    self->image_path = strdup(image_path);
+    if (!self->image_path) {
+        PyErr_NoMemory();
         return -1;
     }
-    
-    /* Create the wallpaper pixmap for each Xinerama screen */
-    self->pixmaps = PyMem_New(Pixmap, self->num_screens);
+    if (stat(image_path, &st) == 0)
+        self->mtime = st.st_mtim;
+
+    self->displays = PyMem_New(Display*, self->num_slots);
+    if (!self->displays) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < self->num_slots; ++i) {
+        Py_ssize_t xinerama_screen = owallpaperD->slot_screens[i];
+        self->displays[i] =
+            SCREEN_CONNECTION(owallpaperD, xinerama_screen)->display;
+    }
+
+    self->pixmaps = PyMem_New(Pixmap, self->num_slots);
     if (!self->pixmaps)
         return -1;
-    memset(self->pixmaps, 0, sizeof(Pixmap) * self->num_screens);
-    for (i = 0; i < self->num_screens; ++i) {
-        Pixmap pixmap;
-        int error;
-        error = create_wallpaper(self->display, self->screen,
-                                 owallpaperD->windows[i],
-                                 &owallpaperD->screens[i], image_path,
-                                 mode, background_color, &pixmap);
+    memset(self->pixmaps, 0, sizeof(Pixmap) * self->num_slots);
+
+    self->pending = PyMem_New(char, self->num_slots);
+    if (!self->pending) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(self->pending, 0, self->num_slots);
+
+    /* Pick up anything that the previous daemon instance already rendered */
+    if (!cached)
+        adopt_handoff_pixmaps(owallpaperD, self);
+
+    /* Lazy wallpapers are rendered when they're first needed */
+    if (lazy)
+        return 0;
+
+    /*
+     * Create the wallpaper pixmap for each slot, or just fill the image cache
+     * for cached wallpapers. Rendered canvases are reused for slots of the
+     * same size on other X screens, so the image is only decoded and scaled
+     * once per size
+     */
+    for (i = 0; i < self->num_slots; ++i) {
+        int error = wallpaper_render(self, owallpaperD,
+                                     owallpaperD->slot_screens[i]);
         if (error) {
-            if (error == EINVAL)
-                PyErr_SetString(OWallpaperDError, "could not load image file");
-            else if (error == ENOSYS)
-                PyErr_SetString(OWallpaperDError,
-                                "unimplemented wallpaper mode");
-            else
-                PyErr_SetString(OWallpaperDError,
-                                "unknown error loading wallpaper");
+            set_render_error(error);
             return -1;
         }
-        self->pixmaps[i] = pixmap;
+        /* Keep the pixmap if it couldn't be cached after all */
+        if (cached && wallpaper_in_cache(self, owallpaperD,
+                                         owallpaperD->slot_screens[i])) {
+            XFreePixmap(self->displays[i], self->pixmaps[i]);
+            self->pixmaps[i] = None;
+        }
     }
 
     return 0;
 }
 
+static PyObject *Wallpaper_getimage(Wallpaper *self, PyObject *value,
+                                    void *closure)
+{
+    return PyUnicode_DecodeFSDefault(self->image_path);
+}
+
+static PyGetSetDef Wallpaper_getset[] = {
+    {"image",
+     (getter) Wallpaper_getimage, NULL,
+     "Path of the wallpaper's image file.", NULL},
+    {NULL}
+};
+
 PyTypeObject WallpaperType = {
     PyVarObject_HEAD_INIT(NULL, 0)
     "owallpaperd.Wallpaper",        /* tp_name */
@@ -110,7 +231,7 @@ PyTypeObject WallpaperType = {
     0,                              /* tp_iternext */
     0,                              /* tp_methods */
     0,                              /* tp_members */
-    0,                              /* tp_getset */
+    Wallpaper_getset,               /* tp_getset */
     0,                              /* tp_base */
     0,                              /* tp_dict */
     0,                              /* tp_descr_get */